@@ -0,0 +1,105 @@
+//    ARM7 side of the DSBrut offload. The uart runs here with its spi
+//    timer and card line irqs, the input is parsed into the shared queue
+//    and the ARM9's output is moved into the uart whenever it has room.
+//    SysEx input is dropped, the ARM9 only gets channel and system
+//    messages this way.
+
+#include <nds.h>
+
+#include "uart.h"
+#include "midi_parser.h"
+#include "dsmi_arm7.h"
+
+#define DSMI_ARM7_CHUNK		32	// bytes moved to the uart at once
+
+static dsmi_arm7_shared* shared = NULL;
+static midi_parser parser;
+
+// Moves the ARM9's output into the uart queues, what doesn't fit stays
+// in the block for the next call. Runs in the FIFO, timer or card line
+// irq, which don't nest.
+static void dsmi_arm7_pull(void)
+{
+	u8 buf[DSMI_ARM7_CHUNK];
+	u16 head, size, n, i;
+
+	head = shared->rt_head;
+	size = (u16)(shared->rt_tail - head);
+	if(size > 0) {
+		for(i = 0; i < size && i < DSMI_ARM7_CHUNK; i++)
+			buf[i] = shared->rt[(head + i) & (DSMI_ARM7_RT_SIZE - 1)];
+		shared->rt_head = head + uart_write_rt(buf, i);
+	}
+
+	do {
+		head = shared->out_head;
+		size = (u16)(shared->out_tail - head);
+		if(size > DSMI_ARM7_CHUNK)
+			size = DSMI_ARM7_CHUNK;
+		for(i = 0; i < size; i++)
+			buf[i] = shared->out[(head + i) & (DSMI_ARM7_OUT_SIZE - 1)];
+		n = size > 0 ? uart_write(buf, size) : 0;
+		shared->out_head = head + n;
+	} while(n == DSMI_ARM7_CHUNK);
+}
+
+// Called from the spi irq when bytes came in
+static void dsmi_arm7_received(void)
+{
+	dsmi_msg msg;
+	uint8* buf;
+	uint16 size, i;
+	int count = 0;
+
+	while((size = uart_peek(&buf)) > 0) {
+		for(i = 0; i < size; i++) {
+			if(!midi_parse(&parser, buf[i], &msg))
+				continue;
+			if(midi_queue_push(&shared->in, &msg))
+				count++;
+			else
+				shared->drops_in++;
+		}
+		uart_skip(size);
+	}
+
+	if(count > 0 && shared->notify)
+		fifoSendValue32(DSMI_ARM7_FIFO, DSMI_ARM7_RECEIVED);
+}
+
+static void dsmi_arm7_value(u32 value, void* data)
+{
+	if(value == DSMI_ARM7_KICK && shared != NULL) {
+		shared->kick = 0;
+		dsmi_arm7_pull();
+	}
+}
+
+// uart_init waits for irqs, so this isn't done in the FIFO handler
+static void dsmi_arm7_start(dsmi_arm7_shared* block)
+{
+	if(shared != NULL || !uart_init()) {
+		fifoSendValue32(DSMI_ARM7_FIFO, shared != NULL ? DSMI_ARM7_READY : DSMI_ARM7_FAILED);
+		return;
+	}
+
+	uart_set_bps(31250); // MIDI baud rate
+
+	midi_parser_init(&parser);
+	shared = block;
+	uart_set_receive_handler(dsmi_arm7_received);
+	uart_set_send_handler(dsmi_arm7_pull);
+
+	fifoSendValue32(DSMI_ARM7_FIFO, DSMI_ARM7_READY);
+}
+
+void dsmi_arm7_init(void)
+{
+	fifoSetValue32Handler(DSMI_ARM7_FIFO, dsmi_arm7_value, 0);
+}
+
+void dsmi_arm7_poll(void)
+{
+	if(fifoCheckAddress(DSMI_ARM7_FIFO))
+		dsmi_arm7_start((dsmi_arm7_shared*)fifoGetAddress(DSMI_ARM7_FIFO));
+}
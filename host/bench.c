@@ -0,0 +1,259 @@
+//    Host benchmark for the parts of libdsmi that don't touch the hardware:
+//    OSC message building and dispatch and the MIDI parser and queue.
+//    "bench trace.mid" parses a raw MIDI byte dump instead of the built in
+//    trace. Times are per message, the measured code does no allocations.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nds.h>
+
+#include "libdsmi.h"
+#include "midi_parser.h"
+
+#define ROUNDS 200000
+
+static volatile int sink;		// keeps results from being optimized away
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char* name, double start, long count)
+{
+	printf("%-28s %8.1f ns/msg\n", name, (now_ns() - start) / count);
+}
+
+// ------------ OSC ------------ //
+
+static void bench_osc_build(void)
+{
+	OSCbuf buf;
+	double start;
+	long i;
+
+	start = now_ns();
+	for(i = 0; i < ROUNDS; i++) {
+		osc_init(&buf);
+		osc_writeaddr(&buf, "/dsmi/note");
+		osc_addintarg(&buf, i & 0x0F);
+		osc_addintarg(&buf, 60);
+		osc_addintarg(&buf, 127);
+		sink += osc_getPacketSize(&buf) + osc_getPacket(&buf)[0];
+	}
+	report("osc build 3 args", start, ROUNDS);
+
+	start = now_ns();
+	for(i = 0; i < ROUNDS; i++) {
+		osc_init(&buf);
+		osc_writeaddr(&buf, "/dsmi/mixer");
+		osc_addstringarg(&buf, "channel");
+		osc_addintarg(&buf, 1);
+		osc_addfloatarg(&buf, 0.5f);
+		osc_addintarg(&buf, 2);
+		osc_addfloatarg(&buf, 0.25f);
+		osc_addintarg(&buf, 3);
+		osc_addfloatarg(&buf, 0.125f);
+		sink += osc_getPacketSize(&buf) + osc_getPacket(&buf)[0];
+	}
+	report("osc build 7 args", start, ROUNDS);
+}
+
+static void bench_osc_template(void)
+{
+	OSCtemplate tpl;
+	double start;
+	long i;
+
+	osc_template_init(&tpl, "/dsmi/note", "iii");
+
+	start = now_ns();
+	for(i = 0; i < ROUNDS; i++) {
+		osc_template_setint(&tpl, 0, i & 0x0F);
+		osc_template_setint(&tpl, 1, 60);
+		osc_template_setint(&tpl, 2, 127);
+		sink += osc_template_getPacketSize(&tpl) + osc_template_getPacket(&tpl)[0];
+	}
+	report("osc template 3 args", start, ROUNDS);
+}
+
+static void osc_handler(OSCmsg* msg, void* user)
+{
+	int32_t arg;
+	if(osc_msg_getint(msg, 0, &arg))
+		sink += arg;
+}
+
+static void bench_osc_dispatch(void)
+{
+	static OSCserver srv;
+	static const char* addrs[] = {
+		"/dsmi/note", "/dsmi/cc", "/dsmi/pc", "/dsmi/sysex",
+		"/synth/1/cutoff", "/synth/1/resonance", "/synth/2/cutoff", "/synth/2/resonance",
+	};
+	OSCbuf exact, pattern;
+	char packet[OSC_MAX_SIZE];
+	int i, size;
+	double start;
+	long n;
+
+	osc_server_init(&srv);
+	for(i = 0; i < (int)(sizeof(addrs) / sizeof(addrs[0])); i++)
+		osc_server_add(&srv, addrs[i], osc_handler, NULL);
+
+	osc_init(&exact);
+	osc_writeaddr(&exact, "/synth/2/cutoff");
+	osc_addintarg(&exact, 64);
+	osc_getPacket(&exact);
+
+	osc_init(&pattern);
+	osc_writeaddr(&pattern, "/synth/*/cutoff");
+	osc_addintarg(&pattern, 64);
+	osc_getPacket(&pattern);
+
+	// dispatch works in the receive buffer, give it a fresh copy every time
+	size = osc_getPacketSize(&exact);
+	start = now_ns();
+	for(n = 0; n < ROUNDS; n++) {
+		memcpy(packet, exact.buffer, size);
+		sink += osc_server_dispatch(&srv, packet, size);
+	}
+	report("osc dispatch exact", start, ROUNDS);
+
+	size = osc_getPacketSize(&pattern);
+	start = now_ns();
+	for(n = 0; n < ROUNDS; n++) {
+		memcpy(packet, pattern.buffer, size);
+		sink += osc_server_dispatch(&srv, packet, size);
+	}
+	report("osc dispatch pattern", start, ROUNDS);
+}
+
+// ------------ MIDI ------------ //
+
+// Note and CC traffic with running status, clock bytes in between and a
+// SysEx every now and then, roughly what a sequencer sends
+static int midi_trace(u8* trace, int size)
+{
+	int pos = 0, i;
+
+	while(pos + 64 <= size) {
+		trace[pos++] = 0x90;
+		for(i = 0; i < 8; i++) {
+			trace[pos++] = 48 + i;
+			if(i == 4)
+				trace[pos++] = 0xF8;
+			trace[pos++] = 100;
+		}
+		trace[pos++] = 0xB0;
+		trace[pos++] = 7;
+		trace[pos] = pos & 0x7F;
+		pos++;
+		trace[pos++] = 0xE0;
+		trace[pos++] = 0x00;
+		trace[pos++] = 0x40;
+		if((pos & 0x3FF) < 64) {
+			trace[pos++] = 0xF0;
+			for(i = 0; i < 16; i++)
+				trace[pos++] = i;
+			trace[pos++] = 0xF7;
+		}
+	}
+	return pos;
+}
+
+static void sysex_handler(u8* data, int size, int flags)
+{
+	sink += size;
+}
+
+static void bench_midi(const u8* trace, int size)
+{
+	static u8 sysex_buf[64];
+	midi_sysex sysex = { sysex_buf, sizeof(sysex_buf), 0, 0, sysex_handler };
+	midi_parser parser;
+	midi_queue queue;
+	dsmi_msg msg;
+	double start;
+	long msgs = 0;
+	int round, rounds, i;
+
+	rounds = ROUNDS * 64 / size + 1;
+
+	midi_parser_init(&parser);
+	parser.sysex = &sysex;
+	start = now_ns();
+	for(round = 0; round < rounds; round++)
+		for(i = 0; i < size; i++)
+			msgs += midi_parse(&parser, trace[i], &msg);
+	if(msgs > 0)
+		report("midi parse", start, msgs);
+
+	midi_queue_init(&queue);
+	start = now_ns();
+	msgs = 0;
+	for(round = 0; round < rounds; round++) {
+		for(i = 0; i < size; i++) {
+			if(midi_parse(&parser, trace[i], &msg) && !midi_queue_push(&queue, &msg))
+				break;
+			// the main thread drains the queue once in a while
+			if((i & 0x3F) == 0x3F)
+				while(midi_queue_pop(&queue, &msg))
+					msgs++;
+		}
+		while(midi_queue_pop(&queue, &msg))
+			msgs++;
+	}
+	if(msgs > 0)
+		report("midi parse + queue", start, msgs);
+}
+
+static u8* midi_load(const char* path, int* size)
+{
+	FILE* f = fopen(path, "rb");
+	u8* trace;
+
+	if(f == NULL)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	trace = malloc(*size > 0 ? *size : 1);
+	if(trace != NULL && fread(trace, 1, *size, f) != (size_t)*size) {
+		free(trace);
+		trace = NULL;
+	}
+	fclose(f);
+	return trace;
+}
+
+int main(int argc, char** argv)
+{
+	static u8 builtin[64 * 1024];
+	u8* trace = builtin;
+	int size;
+
+	if(argc > 1) {
+		trace = midi_load(argv[1], &size);
+		if(trace == NULL || size == 0) {
+			fprintf(stderr, "bench: can't read %s\n", argv[1]);
+			return 1;
+		}
+	} else {
+		size = midi_trace(builtin, sizeof(builtin));
+	}
+
+	bench_osc_build();
+	bench_osc_template();
+	bench_osc_dispatch();
+	bench_midi(trace, size);
+
+	if(trace != builtin)
+		free(trace);
+	return 0;
+}
@@ -0,0 +1,15 @@
+//  Stand-in for libnds on the host, the host build only takes the
+//  sources that need nothing but the integer types from it.
+
+#ifndef HOST_NDS_H
+#define HOST_NDS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#endif
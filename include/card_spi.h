@@ -51,6 +51,32 @@ typedef struct {
 	uint16 enable_irq;
 } CARD_SPI_SETTINGS;
 
+/* Timer ticks per second of the asynchronous engine. Each tick moves up to
+   CARD_SPI_ASYNC_BURST bytes of a transaction back to back, so a tick has
+   to be longer than a burst takes at the SPI clock (8 bytes are 125 us at
+   512 kHz); the time left over is the gap the MCU needs between
+   transactions, a new one always starts on the next tick. */
+#ifndef CARD_SPI_ASYNC_RATE
+#define CARD_SPI_ASYNC_RATE	4096
+#endif
+#ifndef CARD_SPI_ASYNC_BURST
+#define CARD_SPI_ASYNC_BURST	8
+#endif
+
+/* An asynchronous SPI transaction. The caller owns it and the buffers until
+   done is called (from the timer interrupt). */
+typedef struct CARD_SPI_XFER {
+	char *out;			/* bytes to send, NULL sends zeros */
+	char *in;			/* received bytes, NULL drops them */
+	uint16 count;		/* number of bytes to transfer */
+	uint8 sized;		/* if not 0, the last of the count bytes received is
+						   the number of bytes that follow, at most sized */
+	uint16 received;	/* total number of bytes transferred, set when done */
+	void (*done)(struct CARD_SPI_XFER *xfer);
+	void *user;
+	struct CARD_SPI_XFER *next;
+} CARD_SPI_XFER;
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -68,6 +94,19 @@ extern "C" {
 	void cardSpiTransferBuffer(char *out, char *in, uint16 count);
 	void cardSpiWriteBuffer(char *out, uint16 count);
 
+	/* Asynchronous transfers, advanced a burst of bytes per tick of a
+	   hardware timer (the card SPI has neither a completion IRQ nor DMA) */
+	bool cardSpiAsyncInit(uint32 rate);
+	bool cardSpiAsyncRunning();
+	bool cardSpiAsyncSubmit(CARD_SPI_XFER *xfer);
+	bool cardSpiAsyncBusy();
+
+	/* Synchronous transfers lock the bus: interrupts are off from the
+	   outermost lock to its unlock, and a transfer the engine has in
+	   progress is finished first. Locks nest. */
+	void cardSpiLock();
+	void cardSpiUnlock();
+
 #ifdef __cplusplus
 };
 #endif
@@ -84,17 +84,37 @@ extern "C" {
 	void dseWriteRegister(uint8 reg, uint8 val);
 	uint8 dseReadRegister(uint8 reg);
 
+	/* Asynchronous access, transfers are queued and handlers are called from
+	   the interrupt. The calls return false if the queue is full or
+	   dseAsyncInit has not succeeded. After dseAsyncInit the synchronous
+	   calls also queue their transfers and wait for them with interrupts
+	   enabled, outside of interrupts and critical sections. */
+	bool dseAsyncInit();
+	bool dseWriteRegisterAsync(uint8 reg, uint8 val);
+	bool dseReadRegisterAsync(uint8 reg, void (*handler)(uint8 val, void *user), void *user);
+
 	/* Configuration */
 	bool dseInit();
 	DseStatus dseStatus();
 	int dseVersion();
 	bool dseUploadFirmware(char * data, unsigned int fwsize);
+	bool dseUploadFirmwareDelta(char * data, unsigned int fwsize);
+	/* dseUploadFirmwareDelta in steps: each dseUpdateStep checks one flash
+	   page and rewrites it if it differs, and returns the bytes checked so
+	   far; the update is done when that is fwsize */
+	void dseUpdateBegin(char * data, unsigned int fwsize);
+	unsigned int dseUpdateStep();
+	void dseSetProgressHandler(void (*progressHandler)(unsigned int done, unsigned int total));
 	bool dseMatchFirmware(char * data, unsigned int fwsize);
+	bool dseMatchFirmwareStamp(char * data, unsigned int fwsize);
+	bool dseVerifyFirmware(char * data, unsigned int fwsize);
 	bool dseBoot();
 	void dseSetModes(unsigned char modes);
 
 	/* UART */
 	bool dseUartSendBuffer(DseUart uart, char * data, unsigned int size, bool blocking);
+	/* UART1 is only there on DSerial2 and Edge carts, valid after dseInit */
+	bool dseUartEnabled(DseUart uart);
 	bool dseUartSetBaudrate(DseUart uart, unsigned int baudrate);
 	void dseUartSetReceiveHandler(DseUart uart, void (*receiveHandler)(char * data, unsigned int size));
 	void dseUartSetSendHandler(DseUart uart, void (*sendHandler)(void));
@@ -103,10 +123,25 @@ extern "C" {
 	void dsePinMode(uint8 port, uint8 pin, DsePinMode mode);
 	bool dsePinRead(uint8 port, uint8 pin);
 	void dsePinWrite(uint8 port, uint8 pin, bool state);
+	/* sets the latch bits in mask to value, between dsePortBegin and
+	   dsePortFlush every port is written at most once, at the flush */
+	void dsePortWrite(uint8 port, uint8 mask, uint8 value);
+	void dsePortBegin();
+	void dsePortFlush();
 	uint16 dsePinReadAnalog(uint8 port, uint8 pin);
+	/* index of an analog input in the ADC sequence, -1 if it isn't in it */
+	int dseAnalogSequenceIndex(uint8 port, uint8 pin);
+	/* values has 16 entries, the one of an analog pin is [(port - 1) * 8 + pin],
+	   returns the number of analog pins read */
+	uint8 dsePinReadAnalogAll(uint16 * values);
+	bool dsePinReadAsync(uint8 port, uint8 pin, void (*handler)(bool state, void *user), void *user);
+	bool dsePinWriteAsync(uint8 port, uint8 pin, bool state);
+	bool dsePinReadAnalogAsync(uint8 port, uint8 pin, void (*handler)(uint16 val, void *user), void *user);
+	bool dsePinReadAnalogAllAsync(uint16 * values, void (*handler)(uint8 count, void *user), void *user);
 
 	/* Misc */
 	void dseUartDefaultReceiveHandler(char * data, unsigned int size);
+	void dseIrqHandler();
 
 #ifdef __cplusplus
 };
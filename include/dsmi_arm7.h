@@ -0,0 +1,59 @@
+//    DSBrut offload to the ARM7. The ARM7 component (arm7/, linked into
+//    the ARM7 binary) owns the card bus, runs the uart and its MIDI
+//    framing, and exchanges decoded messages and output bytes with the
+//    ARM9 through a block in main RAM. The FIFO only carries wakeups.
+
+#ifndef DSMI_ARM7_H
+#define DSMI_ARM7_H
+
+#include <nds.h>
+
+#include "midi_parser.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Has to be the same on both sides, as does MIDI_QUEUE_SIZE
+#ifndef DSMI_ARM7_FIFO
+#define DSMI_ARM7_FIFO		FIFO_USER_07
+#endif
+
+#define DSMI_ARM7_OUT_SIZE	256	// bytes of serial MIDI output, power of two
+#define DSMI_ARM7_RT_SIZE	16	// bytes of realtime output, power of two
+
+// FIFO values, the block itself is sent once with fifoSendAddress
+#define DSMI_ARM7_KICK		1	// to the ARM7: there is new output
+#define DSMI_ARM7_RECEIVED	2	// to the ARM9: messages were queued, only while notify is set
+#define DSMI_ARM7_READY		3	// to the ARM9: the uart is running
+#define DSMI_ARM7_FAILED	4	// to the ARM9: no DSBrut found
+
+// The rings are single-producer/single-consumer with free-running
+// indices, like the ones in uart.c. The ARM9 only accesses the block
+// through its uncached mirror.
+typedef struct {
+	midi_queue in;			// decoded input, filled by the ARM7
+	u8 out[DSMI_ARM7_OUT_SIZE];	// serial MIDI output, filled by the ARM9
+	volatile u16 out_head;
+	volatile u16 out_tail;
+	u8 rt[DSMI_ARM7_RT_SIZE];	// realtime bytes, they go ahead of out
+	volatile u16 rt_head;
+	volatile u16 rt_tail;
+	volatile u8 kick;		// DSMI_ARM7_KICK sent and not handled yet
+	volatile u8 notify;		// the ARM9 wants DSMI_ARM7_RECEIVED
+	volatile u32 drops_in;		// messages lost because the ARM9 fell behind
+} dsmi_arm7_shared;
+
+#ifdef ARM7
+// Installs the FIFO handler, call once after fifoInit
+void dsmi_arm7_init(void);
+
+// Starts the uart once the ARM9 asks for it, call from the main loop
+void dsmi_arm7_poll(void);
+#endif
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // DSMI_ARM7_H
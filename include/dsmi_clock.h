@@ -0,0 +1,47 @@
+//    Free running time base for DSMI, built on one hardware timer.
+//    The timer counts at BUS_CLOCK/64 (about 1.91us per tick) and the
+//    overflow interrupt extends it to 32 bits, which wrap after about
+//    2.3 hours. Compare tick values by their difference only.
+
+#ifndef DSMI_CLOCK_H
+#define DSMI_CLOCK_H
+
+#include <nds.h>
+
+#define DSMI_CLOCK_HZ		(BUS_CLOCK >> 6)
+
+// Converts milliseconds into clock ticks
+#define DSMI_CLOCK_MS(ms)	((u32)(ms) * (DSMI_CLOCK_HZ / 1000))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Starts the clock on the highest free timer below TIMER3 (which is
+// used by the wifi code). Does nothing if the clock is already running.
+//
+// Returns true if the clock is running, false if no timer was free
+bool dsmi_clock_init(void);
+
+bool dsmi_clock_running(void);
+
+// Returns the current time in ticks, safe to call from interrupts
+u32 dsmi_clock_ticks(void);
+
+// Sets up a second timer as a one-shot alarm that calls handler from
+// its interrupt. Starts the clock if necessary.
+//
+// Returns true if the alarm is available, false if no timer was free
+bool dsmi_clock_alarm_init(void (*handler)(void));
+
+// Arms the alarm for the given time (in ticks), replacing any earlier
+// one. Times in the past fire right away. Safe to call from the handler.
+void dsmi_clock_set_alarm(u32 when);
+
+void dsmi_clock_cancel_alarm(void);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // DSMI_CLOCK_H
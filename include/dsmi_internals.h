@@ -0,0 +1,116 @@
+//    Functions shared between the DSMI source files, not part of the
+//    public interface in libdsmi.h
+
+#ifndef DSMI_INTERNALS_H
+#define DSMI_INTERNALS_H
+
+#include <nds.h>
+
+#include "libdsmi.h"
+#include "midi_parser.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// One per interface, in dsmi_dserial.c, dsmi_dsbrut.c and dsmi_wifi.c.
+// Connecting selects the default one. The functions are the public
+// dsmi_<op>_<interface> ones, or internal ones named the same way, so a
+// library built with a single transport can call them directly.
+typedef struct {
+	int interface;		// DSMI_SERIAL, DSMI_WIFI or DSMI_BRUT, also its dsmi_stats iface index
+	int* enabled;		// set once the interface is connected
+	midi_parser* parser;	// receives the SysEx set by dsmi_set_sysex_receiver
+	void (*write)(u8 message, u8 data1, u8 data2);
+	void (*write_now)(u8 message, u8 data1, u8 data2);	// bypasses batching, safe from interrupts on serial
+	void (*write_batch)(const dsmi_msg* msgs, int n);
+	void (*write_now_batch)(const dsmi_msg* msgs, int n);	// as few transactions as possible, like write_now
+	void (*sync_write)(u8 message);
+	int (*read)(u8* message, u8* data1, u8* data2);
+	int (*sysex_write)(const u8* data, int size);
+	void (*flush)(void);	// sends what was collected since dsmi_write_begin
+	void (*frame)(void);	// work for dsmi_flush, may be NULL
+} dsmi_transport;
+
+#ifndef DSMI_NO_DSERIAL
+extern const dsmi_transport dsmi_dserial_transport;
+int dsmi_dserial_start(void);
+int dsmi_dserial_open(void);
+void dsmi_write_now_dserial(u8 message, u8 data1, u8 data2);
+void dsmi_write_batch_dserial(const dsmi_msg* msgs, int n);
+void dsmi_flush_dserial(void);
+#endif
+
+#ifndef DSMI_NO_DSBRUT
+extern const dsmi_transport dsmi_dsbrut_transport;
+void dsmi_dsbrut_open(void);
+void dsmi_write_now_dsbrut(u8 message, u8 data1, u8 data2);
+void dsmi_write_batch_dsbrut(const dsmi_msg* msgs, int n);
+void dsmi_flush_dsbrut(void);
+#endif
+
+#ifndef DSMI_NO_WIFI
+extern const dsmi_transport dsmi_wifi_transport;
+bool dsmi_wifi_start(void);
+void dsmi_wifi_open(void);
+void dsmi_write_now_wifi(u8 message, u8 data1, u8 data2);
+void dsmi_write_batch_wifi(const dsmi_msg* msgs, int n);
+void dsmi_write_now_batch_wifi(const dsmi_msg* msgs, int n);
+void dsmi_flush_wifi(void);
+
+// sendto must not run in interrupts, these are the way to send from
+// there. The messages (realtime ones too) go out from the main thread,
+// with the next dsmi_flush or wifi read or write.
+void dsmi_wifi_defer(const dsmi_msg* msgs, int n);
+#endif
+
+extern int default_interface;
+
+// Set between dsmi_write_begin and dsmi_write_commit
+extern int dsmi_batching;
+
+// See dsmi_set_read_callback_mode
+extern void (*dsmi_read_callback)(u8 message, u8 data1, u8 data2);
+extern int dsmi_read_callback_mode;
+
+// Makes interface the default one after connecting it
+void dsmi_select_interface(int interface);
+
+// Returns the transport of interface, NULL if it isn't built in
+const dsmi_transport* dsmi_transport_of(int interface);
+
+// Running status slot of the second DSerial port, it follows the
+// settings of DSMI_SERIAL
+#define DSMI_SERIAL_UART1	3
+
+// Puts a message into buf and returns its size on the wire
+int dsmi_pack_serial(u8* buf, u8 message, u8 data1, u8 data2);
+
+// Copies serial MIDI messages from src to dest, leaving out the status
+// bytes running status makes redundant. Returns the size of dest.
+int dsmi_running_status(int interface, u8* dest, const u8* src, int size);
+
+// The receiver forgot the running status, i.e. because of a SysEx
+void dsmi_running_status_reset(int interface);
+
+// Send a message over the given interface right away, bypassing
+// dsmi_write_begin batching. Safe to call from interrupts for DSMI_SERIAL
+// and DSMI_BRUT only, wifi output from there goes through dsmi_wifi_defer.
+void dsmi_write_now(int interface, u8 message, u8 data1, u8 data2);
+void dsmi_sync_write_now(int interface, u8 message);
+
+// Bit n is set while there are routes from interface n, see dsmi_route.c
+extern volatile int dsmi_routed_from;
+
+// Called by the transports for each received message while routing
+// from them. Returns 0 if the message must not be delivered to the
+// application (DSMI_ROUTE_ONLY). The forwarded messages are collected
+// and written when the receive burst is committed.
+int dsmi_route_msg(int from, const dsmi_msg* msg);
+void dsmi_route_commit(int from);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // DSMI_INTERNALS_H
@@ -0,0 +1,57 @@
+//    Transport counters and timing histograms behind dsmi_get_stats.
+//    With DSMI_NO_STATS defined all of it compiles to nothing.
+
+#ifndef DSMI_STATS_H
+#define DSMI_STATS_H
+
+#include <nds.h>
+
+#include "libdsmi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef DSMI_NO_STATS
+
+#define DSMI_HIST_OFF	0xFF
+
+// Counters are updated from interrupts as well as from the main thread.
+// An update is a read-modify-write, so it is done with interrupts
+// disabled, or an interrupt could add to a counter in between and its
+// count would be lost.
+extern dsmi_stats dsmi_counters;
+extern u8 dsmi_hist_timer;	// free running at BUS_CLOCK, DSMI_HIST_OFF if off
+
+// Adds n to a counter, i.e. DSMI_COUNT(iface[DSMI_WIFI].bytes_out, size)
+#define DSMI_COUNT(field, n)		do { \
+		int oldIME_ = enterCriticalSection(); \
+		dsmi_counters.field += (n); \
+		leaveCriticalSection(oldIME_); \
+	} while(0)
+
+// Times the code between DSMI_HIST_BEGIN and DSMI_HIST_END into the
+// histogram id, start has to be declared with DSMI_HIST_DECL
+#define DSMI_HIST_DECL(start)		u16 start
+#define DSMI_HIST_BEGIN(start)		((start) = dsmi_hist_timer != DSMI_HIST_OFF ? TIMER_DATA(dsmi_hist_timer) : 0)
+#define DSMI_HIST_END(id, start)	do { \
+		if(dsmi_hist_timer != DSMI_HIST_OFF) \
+			dsmi_hist_add((id), (u16)(TIMER_DATA(dsmi_hist_timer) - (start))); \
+	} while(0)
+
+void dsmi_hist_add(int id, u16 ticks);
+
+#else
+
+#define DSMI_COUNT(field, n)		do { } while(0)
+#define DSMI_HIST_DECL(start)
+#define DSMI_HIST_BEGIN(start)		((void)0)
+#define DSMI_HIST_END(id, start)	((void)0)
+
+#endif // DSMI_NO_STATS
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // DSMI_STATS_H
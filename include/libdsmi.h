@@ -15,6 +15,11 @@
 //                                                                             //
 /////////////////////////////////////////////////////////////////////////////////
 
+#ifndef LIBDSMI_H
+#define LIBDSMI_H
+
+#include "osc_client.h"
+#include "osc_server.h"
 
 // Message types must be sent with a MIDI Channel # (see MIDI spec for more details)
 // Usage like so:  write_MIDI(NOTE_ON|0x01, 60, 127);
@@ -42,6 +47,13 @@
 #define DSMI_WIFI	1
 #define DSMI_BRUT	2
 
+// A MIDI message as returned by the read functions. For messages with
+// only one data byte data2 is 0, for realtime messages both are 0.
+typedef struct {
+	u8 message;
+	u8 data1;
+	u8 data2;
+} dsmi_msg;
 
 #ifdef __cplusplus
 extern "C" {
@@ -58,11 +70,53 @@ extern "C" {
 extern int dsmi_connect(void);
 
 // Using these you can force a wifi connection even if a DSerial is
-// inserted or set up both connections for forwarding.
+// inserted or set up both connections for forwarding (see ROUTING).
+//
+// The reduced libraries (libdsmi-wifi.a, libdsmi-serial.a, see the
+// Makefile) don't have the functions of the transports left out, and
+// dsmi_connect only tries the ones built in. With a single transport the
+// default interface functions are that transport's, also before connecting.
 extern int dsmi_connect_dserial(void);
 extern int dsmi_connect_dsbrut(void);
 extern int dsmi_connect_wifi(void);
 
+// Like dsmi_connect_dsbrut, but the DSBrut is run from the ARM7, which
+// leaves the ARM9 free of the spi timer and card line interrupts. The
+// ARM7 binary has to be linked with libdsmi7.a (arm7/) and call
+// dsmi_arm7_init once and dsmi_arm7_poll in its main loop. SysEx input
+// from the DSBrut is dropped this way. Returns 0 if the ARM7 didn't
+// answer or found no DSBrut.
+extern int dsmi_connect_dsbrut_arm7(void);
+
+// dsmi_connect without freezing the program: dsmi_connect_begin starts it
+// and dsmi_connect_poll (to be called once per frame) does one step each,
+// returning the current state. The DSerial firmware is checked (and
+// rewritten where it differs) one flash page per step, and the firmware
+// boot, DSBrut probe, wifi initialization and association are waited
+// for over the following polls while the program keeps running.
+#define DSMI_CONNECT_IDLE		0
+#define DSMI_CONNECT_DSERIAL		1	// probing the DSerial
+#define DSMI_CONNECT_DSERIAL_UPLOAD	2	// checking and updating the DSerial firmware
+#define DSMI_CONNECT_DSERIAL_BOOT	3	// waiting for the DSerial firmware to start
+#define DSMI_CONNECT_DSBRUT		4	// probing the DSBrut
+#define DSMI_CONNECT_DSBRUT_WAIT	5	// waiting for the DSBrut to answer
+#define DSMI_CONNECT_WIFI_INIT		6	// waiting for the wifi library
+#define DSMI_CONNECT_WIFI_ASSOC		7	// associating with the access point
+#define DSMI_CONNECT_DONE		8	// connected, see dsmi_get_default_interface
+#define DSMI_CONNECT_FAILED		9
+
+extern void dsmi_connect_begin(void);
+extern int dsmi_connect_poll(void);
+
+// Bytes of the DSerial firmware checked so far out of total, for a
+// progress bar during DSMI_CONNECT_DSERIAL_UPLOAD
+extern void dsmi_connect_get_progress(unsigned int* done, unsigned int* total);
+
+// When the DSerial firmware is out of date, connecting rewrites the flash
+// pages that differ, which can take a few seconds. The handler is called
+// after each page with the number of bytes done out of total.
+extern void dsmi_set_upload_progress_handler(void (*handler)(unsigned int done, unsigned int total));
+
 
 
 // ------------ WRITE ------------ //
@@ -73,12 +127,66 @@ extern void dsmi_write(u8 message,u8 data1, u8 data2);
 // Force a MIDI message to be sent over DSerial
 extern void dsmi_write_dserial(u8 message,u8 data1, u8 data2);
 
+// DSerial writes are queued and sent from the UART0 TX interrupt, so
+// they return immediately. These report the number of bytes still
+// waiting to be sent and the number of writes dropped because the queue
+// (256 bytes) was full, to allow for backpressure.
+extern int dsmi_dserial_tx_pending(void);
+extern u32 dsmi_dserial_tx_drops(void);
+
 // Force a MIDI message to be sent over DSBrut
 extern void dsmi_write_dsbrut(u8 message,u8 data1, u8 data2);
 
 // Force a MIDI message to be sent over Wifi
 extern void dsmi_write_wifi(u8 message,u8 data1, u8 data2);
 
+// ------------ BATCHED WRITE ------------ //
+// Sending each message on its own costs a full transport transaction
+// (a SPI write or an UDP datagram). Batching packs the messages into as
+// few transactions as the transport allows (MAX_DATA_SIZE bytes per
+// DSerial write, one datagram for wifi).
+
+// Sends n messages over the default interface as one batch
+extern void dsmi_write_batch(const dsmi_msg* msgs, int n);
+
+// All dsmi_write* calls between these two are collected and sent on commit
+extern void dsmi_write_begin(void);
+extern void dsmi_write_commit(void);
+
+// ------------ WIFI COALESCING ------------ //
+// The DS radio is limited by packets per second much more than by bytes.
+// With coalescing on, wifi output (MIDI and OSC) is collected for up to
+// window_ms milliseconds, or until dsmi_flush with DSMI_COALESCE_FRAME,
+// and sent as one datagram per kind. 0 turns it off (the default).
+// System realtime messages are still sent right away.
+//
+// Returns 1 if the mode was set, 0 if not (no free timer for the window)
+#define DSMI_COALESCE_FRAME	-1
+
+extern int dsmi_set_wifi_coalescing(int window_ms);
+
+// Sends coalesced output whose window has not passed yet, and the keepalive
+// beacon the DSMIDIWiFi server expects after 3 seconds without output.
+// Neither is sent from interrupts, so call dsmi_flush (or dsmi_read) once
+// per frame when using wifi. DSerial output the card had no room for is
+// sent again from here too.
+extern void dsmi_flush(void);
+
+// ------------ RUNNING STATUS ------------ //
+// Serial MIDI can leave out the status byte when it is the same as the
+// one of the previous message, which fits about a third more messages
+// on the wire. As some receivers lose track of it, the full status byte
+// is sent again after refresh_ms milliseconds (0 to never refresh).
+// Only applies to DSMI_SERIAL and DSMI_BRUT, it is disabled by default.
+//
+// Returns 1 if the mode was set, 0 if not (no free timer for refreshing)
+extern int dsmi_set_running_status(int interface, int enable, int refresh_ms);
+
+// System realtime messages (0xF8 - 0xFF, e.g. clock, start and stop) sent
+// with these cut ahead of queued output on all interfaces and are never
+// held back by dsmi_write_begin. On the serial interfaces they
+// may even go out in the middle of another message, which MIDI allows.
+
 // Send a MIDI SYNC Systemmessage over the default interface, see MIDI spec for more details
 extern void dsmi_sync_write(u8 message);
 
@@ -91,6 +199,97 @@ extern void dsmi_sync_write_dsbrut(u8 message);
 // Force a MIDI SYNC Systemmessage to be sent over Wifi
 extern void dsmi_sync_write_wifi(u8 message);
 
+// ------------ SCHEDULED WRITE ------------ //
+// Messages can be queued with a timestamp, they are then sent from a
+// timer interrupt when they are due instead of whenever the application
+// gets to call dsmi_write. Times are given in ticks of DSMI_TIME_HZ
+// (about 1.91us) and wrap after about 2.3 hours, so only compare them
+// by their difference. The scheduler uses two free hardware timers
+// (out of TIMER0-2), events go to the interface that was the default
+// one when they were scheduled. Wifi can't send from the interrupt, due
+// wifi events go out with the next dsmi_flush (or wifi read or write),
+// which is as exact as the frame it is called in.
+
+#define DSMI_TIME_HZ	(BUS_CLOCK >> 6)
+
+// Convert milliseconds / microseconds into ticks
+#define DSMI_MS(ms)		((u32)(((u64)(ms) * DSMI_TIME_HZ) / 1000))
+#define DSMI_US(us)		((u32)(((u64)(us) * DSMI_TIME_HZ) / 1000000))
+
+// Returns the current time in ticks
+extern u32 dsmi_get_time(void);
+
+// Schedule a MIDI message / MIDI SYNC Systemmessage for the given time
+//
+// Returns 1 if the event was queued, 0 if the queue (128 events) is
+// full or no timers were free
+extern int dsmi_schedule_write(u32 time, u8 message, u8 data1, u8 data2);
+extern int dsmi_schedule_sync_write(u32 time, u8 message);
+
+// Returns the number of events waiting to be sent
+extern int dsmi_schedule_pending(void);
+
+// Drops all pending events
+extern void dsmi_schedule_clear(void);
+
+// ------------ ANALOG CC MAPPING ------------ //
+// DSerial analog pins (set up with dsePinMode(port, pin, ANALOG_INPUT))
+// can be sent as MIDI CCs over the default interface. The ADC value has
+// to move by more than deadband (out of 1023) before a new CC is sent,
+// and only CCs whose value changed are sent at all.
+
+// Returns 1 if the pin was mapped, 0 if it can't be analog or isn't set
+// up as one (call it after dsmi_connect and dsePinMode)
+extern int dsmi_analog_map(u8 port, u8 pin, u8 channel, u8 cc, int deadband);
+extern void dsmi_analog_unmap(u8 port, u8 pin);
+
+// Reads all analog pins in one pass and sends the changed CCs, call it
+// once per frame. Returns the number of CCs sent. With the DSerial in
+// async mode the pins are read in the background, the CCs of a pass go
+// out with the call after it finished.
+extern int dsmi_analog_update(void);
+
+// ------------ SYSEX ------------ //
+// SysEx of any length is written in pieces of any size (the F0 and F7
+// included), they are cut to fit the transport: 32 byte frames for
+// DSerial, an escaped byte stream for DSBrut and datagrams of up to 512
+// raw bytes for wifi (to be read as DSMI_WIFI_RX_STREAM). Realtime
+// messages keep cutting ahead of it, other messages must not be written
+// to the interface until the SysEx has ended.
+
+// Queues as much of data as the interface takes without waiting and
+// returns the number of bytes taken, call again with the rest
+extern int dsmi_sysex_write(const u8* data, int size);
+extern int dsmi_sysex_write_dserial(const u8* data, int size);
+extern int dsmi_sysex_write_dsbrut(const u8* data, int size);
+extern int dsmi_sysex_write_wifi(const u8* data, int size);
+
+// Streams a SysEx over the default interface from a callback that fills
+// buf with up to max bytes and returns their number, 0 at the end. The
+// callback is pulled whenever the transport has room, from dsmi_sysex_poll
+// (or dsmi_flush), call it once per frame.
+//
+// Returns 1 if the stream was started, 0 if not connected
+extern int dsmi_sysex_stream(int (*pull)(u8* buf, int max, void* user), void* user);
+
+// Returns 1 while the stream is still running
+extern int dsmi_sysex_poll(void);
+
+// Stops the stream (the receiver sees an unfinished SysEx)
+extern void dsmi_sysex_cancel(void);
+
+// Received SysEx is collected into buffer, which the handler gets each
+// time it is full and when the SysEx ends, so a dump never has to fit into
+// memory at once. flags tell where the piece is in the SysEx. For DSerial
+// the handler is called from the card interrupt. SysEx is received on
+// all interfaces (in wifi stream mode only), but one at a time.
+// A NULL buffer turns receiving off, SysEx is dropped then (the default).
+#define DSMI_SYSEX_START	1	// the piece starts with the F0
+#define DSMI_SYSEX_END		2	// the piece is the last one
+#define DSMI_SYSEX_ABORTED	4	// ended by another status byte, there is no F7
+
+extern void dsmi_set_sysex_receiver(u8* buffer, int size, void (*handler)(u8* data, int size, int flags));
+
 // ------------ OSC WRITE ------------ //
 // OSC messages are sent only over wifi and do not require the dsmidiwifi server application
 //   To send and OSC message:
@@ -110,9 +309,71 @@ extern int dsmi_osc_addstringarg( char* arg);
 // Sends the OSC packet
 extern int dsmi_osc_send(void);
 
+// ------------ OSC TEMPLATES ------------ //
+// For messages sent over and over with the same address and argument types,
+// an OSCtemplate encodes the packet once, the arguments are then changed in
+// place and the template is sent without building a new packet:
+//     OSCtemplate xy;
+//     osc_template_init( &xy, "/xy", "ff");
+//     ...
+//     osc_template_setfloat( &xy, 0, x);
+//     osc_template_setfloat( &xy, 1, y);
+//     dsmi_osc_template_send( &xy);
+
+extern int dsmi_osc_template_send( OSCtemplate* tpl);
+
+// ------------ OSC BUNDLES ------------ //
+// Sending several OSC messages per frame costs one datagram each. Between
+// dsmi_osc_bundle_begin and dsmi_osc_bundle_send, dsmi_osc_send instead
+// collects the messages into a bundle (up to OSC_MAX_BUNDLE_SIZE bytes,
+// 1024 by default) that is sent as one datagram. A full bundle is sent
+// automatically and a new one with the same timetag is started.
+
+// Starts a bundle, the timetag is an NTP time (seconds since 1900 and
+// fractions of a second), 0 and 1 means "immediately"
+extern void dsmi_osc_bundle_begin( unsigned int sec, unsigned int frac);
+
+// Sends the bundle
+extern int dsmi_osc_bundle_send(void);
+
+// ------------ OSC RECEIVE ------------ //
+// OSC packets sent to the DS on port 9003 are dispatched to handlers that
+// are registered by address. Incoming address patterns ( '*', '?', '[]',
+// '{}') are supported. The arguments can be read with osc_msg_getint,
+// osc_msg_getfloat, osc_msg_getstring and osc_msg_getblob, the message
+// points into the receive buffer and is only valid during the handler call.
+
+// Registers a handler, the address string is not copied. Returns 0 if
+// there are already OSC_MAX_HANDLERS handlers.
+extern int dsmi_osc_add_handler( const char* address, OSChandler handler, void* user);
+
+// Receives all pending OSC packets and calls their handlers, call it once
+// per frame. Returns the number of handler calls.
+extern int dsmi_osc_dispatch(void);
+
 // ------------ READ ------------ //
 
+// Instead of polling with dsmi_read, received messages of all connected
+// interfaces can be handed to a callback. In the default deferred mode
+// the messages are queued as they arrive and dsmi_dispatch, called once
+// per frame or whenever convenient, calls the callback for each one.
+// In IRQ mode DSerial and DSBrut messages are handed over right from the
+// receive interrupt as soon as they are complete. Don't call dsmi_read
+// for these then, and only do what is safe in an interrupt in the
+// callback (writing to DSerial or DSBrut is, outside of dsmi_write_begin
+// and commit).
+// Wifi has no receive interrupt, its messages always come through
+// dsmi_dispatch. A NULL callback turns it off.
+#define DSMI_CALLBACK_DEFERRED	0
+#define DSMI_CALLBACK_IRQ	1
+
 extern void dsmi_set_read_callback(void (*onData_)(u8 message, u8 data1, u8 data2));
+extern void dsmi_set_read_callback_mode(void (*onData_)(u8 message, u8 data1, u8 data2), int mode);
+
+// Calls the read callback for every message received since the last call
+//
+// Returns the number of messages delivered
+extern int dsmi_dispatch(void);
 
 // Checks if a new message arrived at the default interface and returns it by
 // filling the given pointers
@@ -121,11 +382,148 @@ extern void dsmi_set_read_callback(void (*onData_)(u8 message, u8 data1, u8 data
 extern int dsmi_read(u8* message, u8* data1, u8* data2);
 
 // Force receiving over DSerial
-// extern int dsmi_read_dserial(u8* message, u8* data1, u8* data2); // TODO
+extern int dsmi_read_dserial(u8* message, u8* data1, u8* data2);
+
+// Force receiving over DSBrut
+extern int dsmi_read_dsbrut(u8* message, u8* data1, u8* data2);
+
+// Receives up to max messages over DSBrut in one call, decoding them
+// straight from the uart input queue
+//
+// Returns the number of messages written to msgs
+extern int dsmi_read_dsbrut_batch(dsmi_msg* msgs, int max);
 
 // Force receiving over Wifi
 extern int dsmi_read_wifi(u8* message, u8* data1, u8* data2);
 
+// A datagram can hold several messages, all pending datagrams are received
+// at once and queued. The receive mode sets how datagrams are split:
+#define DSMI_WIFI_RX_RECORDS	0	// fixed 3 byte records, as sent by DSMIDIWiFi (default)
+#define DSMI_WIFI_RX_STREAM	1	// MIDI byte stream, with running status
+
+extern void dsmi_set_wifi_receive_mode(int mode);
+
+// Wifi output (MIDI and OSC) starts out as subnet broadcast. Once a MIDI
+// packet arrives, output goes to its sender only, until nothing was received
+// from it for 10 seconds. dsmi_set_peer sends to the given address ( network
+// byte order, like Wifi_GetIP returns) for good, 0 goes back to broadcast.
+extern void dsmi_set_peer(unsigned long ip);
+
+// ------------ DSERIAL PORTS ------------ //
+// DSerial2 and Edge carts have a second UART, which dsmi_connect_dserial
+// sets up as a second MIDI port at 31250 baud. Port 0 is UART0, the one
+// the other dsmi_*_dserial functions use, port 1 is UART1. Each port has
+// its own transmit queue, so both send at the same time. Input of port 1
+// is only queued for dsmi_read_dserial_port, it isn't routed or handed
+// to the read callback, and its SysEx is dropped. Running status follows
+// dsmi_set_running_status for DSMI_SERIAL. Dropped writes of both ports
+// are counted by dsmi_dserial_tx_drops.
+#define DSMI_DSERIAL_PORTS	2
+
+// Returns the number of ports, 0 if the DSerial isn't connected
+extern int dsmi_dserial_ports(void);
+
+// Calls for a port that isn't there do nothing and return 0
+extern void dsmi_write_dserial_port(int port, u8 message, u8 data1, u8 data2);
+extern void dsmi_write_batch_dserial_port(int port, const dsmi_msg* msgs, int n);
+extern void dsmi_sync_write_dserial_port(int port, u8 message);
+extern int dsmi_read_dserial_port(int port, u8* message, u8* data1, u8* data2);
+extern int dsmi_dserial_tx_pending_port(int port);
+
+// ------------ ROUTING ------------ //
+// Routes forward messages received on one interface to another one, e.g.
+// to use the DS as a wireless MIDI interface for a DSerial. They are
+// forwarded in the receive path: DSerial and DSBrut input from the receive
+// interrupt, wifi input whenever it is received (dsmi_read, dsmi_dispatch
+// or dsmi_flush, which should be called once per frame then). What came
+// in at once goes out together, as one DSerial write or one datagram.
+// Realtime messages take the realtime lane of the serial outputs right
+// away. Wifi isn't sent to from interrupts: what DSerial and DSBrut input
+// routes to wifi waits for the next dsmi_flush (or wifi read or write).
+//
+// channels has bit n set for MIDI channel n + 1 (system messages are
+// not filtered by channel), types is a combination of:
+#define DSMI_ROUTE_NOTE_OFF	0x0001
+#define DSMI_ROUTE_NOTE_ON	0x0002
+#define DSMI_ROUTE_POLY_AT	0x0004	// polyphonic aftertouch
+#define DSMI_ROUTE_CC		0x0008
+#define DSMI_ROUTE_PROGRAM	0x0010
+#define DSMI_ROUTE_CHANNEL_AT	0x0020	// channel aftertouch
+#define DSMI_ROUTE_PITCH_BEND	0x0040
+#define DSMI_ROUTE_SYSTEM	0x0080	// system common messages, SysEx isn't forwarded
+#define DSMI_ROUTE_REALTIME	0x0100	// clock, start, stop, ...
+#define DSMI_ROUTE_ALL		0x01FF
+#define DSMI_ROUTE_ONLY		0x8000	// forwarded messages aren't read by the application
+
+#define DSMI_CHANNELS_ALL	0xFFFF
+
+#define DSMI_ROUTES		8	// size of the routing table
+
+// Forwarded messages are also read by the application as usual unless
+// the route has DSMI_ROUTE_ONLY, read them or their queue fills up. A
+// message matching several routes to the same output is sent each time.
+// Returns the route, or -1 if the table is full or an interface isn't
+// built in. Nothing is forwarded to an interface before it is connected.
+extern int dsmi_route_add(int from, int to, u16 channels, u16 types);
+extern void dsmi_route_remove(int route);
+extern void dsmi_route_clear(void);
+
+
+
+// ------------ STATISTICS ------------ //
+// Counters for every interface and the DSBrut SPI link, to see where
+// bytes get lost. Building with DSMI_NO_STATS leaves them out, then
+// dsmi_get_stats returns all zeros.
+
+typedef struct {
+	u32 bytes_out;		// bytes handed to the transport
+	u32 bytes_in;
+	u32 msgs_out;
+	u32 msgs_in;
+	u32 drops_out;		// writes dropped (queue full, failed sendto)
+	u32 drops_in;		// bytes or messages dropped (queue full)
+	u32 short_writes;	// writes the transport only took part of
+} dsmi_iface_stats;
+
+// Histograms count calls by how long they took in ticks of BUS_CLOCK
+// (two CPU cycles): bin n holds calls of 2^n to 2^(n+1)-1 ticks. The
+// timer is 16 bits wide, calls over about 1.9ms are counted short.
+#define DSMI_HIST_BINS		16
+
+#define DSMI_HIST_DO_SPI	0	// DSBrut spi irq
+#define DSMI_HIST_DSERIAL_IRQ	1	// DSerial card interrupt
+#define DSMI_HIST_WRITE_DSERIAL	2	// dsmi_write_dserial
+#define DSMI_HIST_WRITE_DSBRUT	3	// dsmi_write_dsbrut
+#define DSMI_HIST_WRITE_WIFI	4	// dsmi_write_wifi
+#define DSMI_HIST_COUNT		5
+
+typedef struct {
+	u32 calls;
+	u32 max;
+	u32 bins[DSMI_HIST_BINS];
+} dsmi_histogram;
+
+typedef struct {
+	dsmi_iface_stats iface[3];	// by DSMI_SERIAL, DSMI_WIFI and DSMI_BRUT
+	u32 escape_bytes;		// DSBrut escape bytes sent and received
+	u32 prio_timeouts;		// DSBrut priority writes that timed out
+	u32 spi_transactions;		// DSBrut spi exchanges (one per irq)
+	u32 timer_irqs;			// DSBrut spi timer irqs
+	u32 line_irqs;			// DSBrut card line irqs
+	u32 dserial_irqs;		// DSerial card interrupts
+	dsmi_histogram hist[DSMI_HIST_COUNT];
+} dsmi_stats;
+
+// Copies the counters into stats
+extern void dsmi_get_stats(dsmi_stats* stats);
+
+extern void dsmi_reset_stats(void);
+
+// Histograms take a free hardware timer and are off by default.
+// Returns 1 if the histograms are on (or off if enable is 0), 0 if no
+// timer was free.
+extern int dsmi_enable_histograms(int enable);
+
 
 
 // ------------ MISC ------------ //
@@ -138,3 +536,5 @@ extern int dsmi_get_default_interface(void);
 #ifdef __cplusplus
 };
 #endif
+
+#endif // LIBDSMI_H
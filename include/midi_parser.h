@@ -0,0 +1,79 @@
+//    MIDI byte stream parsing and message queueing shared by the
+//    DSMI interfaces. The parser turns a raw MIDI byte stream into
+//    messages (running status, interleaved realtime bytes), the queue
+//    hands them from interrupt handlers to the main thread.
+
+#ifndef MIDI_PARSER_H
+#define MIDI_PARSER_H
+
+#include <nds.h>
+
+#include "libdsmi.h"
+
+// Number of messages a queue can hold, must be a power of two
+#ifndef MIDI_QUEUE_SIZE
+#define MIDI_QUEUE_SIZE 64
+#endif
+
+#define MIDI_QUEUE_MASK (MIDI_QUEUE_SIZE - 1)
+
+#if (MIDI_QUEUE_SIZE & MIDI_QUEUE_MASK)
+#error "MIDI_QUEUE_SIZE must be a power of two"
+#endif
+
+// Collects SysEx bytes (including F0 and F7) into a buffer and hands
+// it to the handler whenever it is full and when the SysEx ends
+typedef struct {
+	u8* buffer;
+	int size;
+	int count;		// bytes in buffer
+	int flags;		// DSMI_SYSEX_START if buffer starts with the F0
+	void (*handler)(u8* data, int size, int flags);
+} midi_sysex;
+
+typedef struct {
+	u8 status;		// running status, 0 if none
+	u8 length;		// number of data bytes the current status takes
+	u8 count;		// number of data bytes received so far
+	u8 data[2];
+	midi_sysex* sysex;	// where SysEx goes, NULL to drop it
+} midi_parser;
+
+// Single-producer/single-consumer ring of messages. The producer may
+// run in interrupt context, the consumer must not be interrupted by
+// another consumer.
+typedef struct {
+	dsmi_msg msgs[MIDI_QUEUE_SIZE];
+	volatile u16 head;	// index of next message to pop
+	volatile u16 tail;	// index of next free slot
+} midi_queue;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returns the number of data bytes following the given status byte
+int midi_msg_length(u8 status);
+
+// Resets the parser state, the SysEx receiver is kept
+void midi_parser_init(midi_parser* parser);
+
+// Feeds one byte into the parser. Returns 1 and fills msg if the byte
+// completed a message, 0 otherwise.
+int midi_parse(midi_parser* parser, u8 byte, dsmi_msg* msg);
+
+void midi_queue_init(midi_queue* queue);
+
+// Returns 1 if the message was queued, 0 if the queue is full
+int midi_queue_push(midi_queue* queue, const dsmi_msg* msg);
+
+// Returns 1 and fills msg if a message was queued, 0 if the queue is empty
+int midi_queue_pop(midi_queue* queue, dsmi_msg* msg);
+
+int midi_queue_count(midi_queue* queue);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // MIDI_PARSER_H
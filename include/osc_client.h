@@ -3,9 +3,18 @@
 //    Basic OSC client implementation with fixed maximum packet size...
 //    Can add up to 31 arguments to OSC packets given none are gigantic strings
 
+#ifndef OSC_CLIENT_H
+#define OSC_CLIENT_H
+
+#include <stdint.h>
 
 #define OSC_MAX_SIZE 256
-#define OSC_MAX_ARGS 32  //actually 31 but type string starts with ',' which takes up one of the bytes
+#define OSC_MAX_ARGS 32  //actually 30 since the type string starts with ',' and ends with at least one '\0'
+
+// Bundles can be bigger than single messages, up to the size of a datagram
+#ifndef OSC_MAX_BUNDLE_SIZE
+#define OSC_MAX_BUNDLE_SIZE 1024
+#endif
 
 #define OSC_EMPTY 0
 #define OSC_ADDRESS 1
@@ -19,15 +28,50 @@ typedef struct OSCbuf_struct {
 	int status;			//keep track of packet's development
 } OSCbuf;
 
+typedef struct OSCbundle_struct {
+    char buffer[OSC_MAX_BUNDLE_SIZE];     // "#bundle", timetag and the size prefixed elements
+    int pos;            //offset of next empty position as we fill the buffer
+    int numelems;       //number of messages (or bundles) in the bundle
+} OSCbundle;
+
+// A message with a fixed address and type tags ( only 'i' and 'f'), encoded
+// once. The arguments are slots that are patched in place before each send.
+typedef struct OSCtemplate_struct {
+	char buffer[OSC_MAX_SIZE];	// the complete packet
+	int size;			// packet size, fixed after osc_template_init
+	int numargs;
+	int posArgs;			// offset of the first argument slot
+	int posTypeString;		// offset of the ',' of the type string
+} OSCtemplate;
+
 void osc_init( OSCbuf* buf);
 int osc_writeaddr( OSCbuf* buf, char* addr);
 
-int osc_addintarg( OSCbuf* buf, long arg);
+int osc_addintarg( OSCbuf* buf, int32_t arg);
 int osc_addfloatarg( OSCbuf* buf, float arg);
 int osc_addstringarg( OSCbuf* buf, char* arg);
 
 char* osc_getPacket( OSCbuf* buf );
 int osc_getPacketSize( OSCbuf* buf );
 
+// timetags are NTP format: seconds since 1900 and fractions of a second,
+// 0 seconds with 1 fraction means "immediately"
+void osc_bundle_init( OSCbundle* bundle, unsigned int sec, unsigned int frac);
+int osc_bundle_add( OSCbundle* bundle, char* packet, int size);
+int osc_bundle_fits( OSCbundle* bundle, int size);
+
+char* osc_bundle_getPacket( OSCbundle* bundle);
+int osc_bundle_getPacketSize( OSCbundle* bundle);
+
+// types is the type tags without the leading ',', i.e. "iif"
+int osc_template_init( OSCtemplate* tpl, char* addr, char* types);
+int osc_template_setint( OSCtemplate* tpl, int slot, int32_t arg);
+int osc_template_setfloat( OSCtemplate* tpl, int slot, float arg);
+
+char* osc_template_getPacket( OSCtemplate* tpl);
+int osc_template_getPacketSize( OSCtemplate* tpl);
+
 int osc_copyPaddedString(char *dest, char *src);
 int osc_stringLength( char* str);
+
+#endif
@@ -0,0 +1,75 @@
+//  OSC receive side to go with fishuyo's client
+//    Packets are validated and walked in the receive buffer without copying,
+//    messages are dispatched to handlers registered by address.
+
+#ifndef OSC_SERVER_H
+#define OSC_SERVER_H
+
+#include <stdint.h>
+
+#ifndef OSC_MAX_HANDLERS
+#define OSC_MAX_HANDLERS 32		// at most 32, pattern matches are kept as a bitmask
+#endif
+
+#define OSC_HASH_SIZE 64		// buckets for exact addresses, power of two
+#define OSC_PATTERN_CACHE_SIZE 8	// incoming patterns remembered with their matches
+#define OSC_PATTERN_MAX_LENGTH 64	// longer patterns are matched every time
+#define OSC_MAX_BUNDLE_DEPTH 4
+
+// A received message, all pointers point into the receive buffer
+typedef struct OSCmsg_struct {
+	char* address;
+	char* types;		// type tags, without the leading ','
+	char* args;		// first argument
+	char* end;		// end of the message
+	int numargs;
+	uint32_t timetag_sec;	// timetag of the enclosing bundle, 0 and 1 ( "immediately")
+	uint32_t timetag_frac;	// if the message was not in a bundle
+} OSCmsg;
+
+typedef void (*OSChandler)( OSCmsg* msg, void* user);
+
+typedef struct OSChandler_entry_struct {
+	const char* address;	// not copied, must stay valid
+	uint32_t hash;
+	OSChandler handler;
+	void* user;
+	int next;		// next entry in the same bucket, -1 at the end
+} OSChandler_entry;
+
+typedef struct OSCpattern_entry_struct {
+	char pattern[OSC_PATTERN_MAX_LENGTH];
+	uint32_t hash;
+	uint32_t matches;	// bit n set if handler n matches the pattern
+} OSCpattern_entry;
+
+typedef struct OSCserver_struct {
+	OSChandler_entry handlers[OSC_MAX_HANDLERS];
+	int numhandlers;
+	signed char buckets[OSC_HASH_SIZE];
+	OSCpattern_entry patterns[OSC_PATTERN_CACHE_SIZE];
+	int nextpattern;	// cache entry to replace next
+} OSCserver;
+
+void osc_server_init( OSCserver* srv);
+
+// Registers a handler for an address ( i.e. "/synth/cutoff"), more than one
+// handler can be registered for the same address. Returns 0 if full.
+int osc_server_add( OSCserver* srv, const char* address, OSChandler handler, void* user);
+
+// Walks a received packet ( message or bundle) and calls the handlers of
+// every message in it. Returns the number of handler calls, or -1 if the
+// packet is malformed. Nothing is dispatched from a malformed packet.
+int osc_server_dispatch( OSCserver* srv, char* packet, int size);
+
+// Matches an OSC address pattern ( '*', '?', '[]', '{}') against an address
+int osc_pattern_match( const char* pattern, const char* address);
+
+// Argument access, return 0 if the argument doesn't exist or has another type.
+// int and float also accept each other and are converted.
+int osc_msg_getint( OSCmsg* msg, int index, int32_t* arg);
+int osc_msg_getfloat( OSCmsg* msg, int index, float* arg);
+int osc_msg_getstring( OSCmsg* msg, int index, char** arg);
+int osc_msg_getblob( OSCmsg* msg, int index, char** data, int* size);
+
+#endif
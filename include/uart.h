@@ -15,10 +15,31 @@ extern "C" {
 bool uart_init();
 
 
+/**
+ *		start initializing the uart library without waiting for the card.
+ *
+ *		uart_init_poll() has to be called afterwards (e.g. once per
+ *		frame) until it returns something else than 0.
+ *		@return			false if there is no free timer
+ */
+bool uart_init_begin();
+
+
+/**
+ *		check once whether the card answered, see uart_init_begin().
+ *
+ *		@return			1 if the uart is ready, -1 if there is none, 
+ *						0 if it has to be called again
+ */
+int8 uart_init_poll();
+
+
 /**
  *		write the content of a buffer to the uart device.
  *
  *		this function internally escapes null-bytes and backspace chars.
+ *		the output queue is a ring buffer of UART_OUT_SIZE bytes (see 
+ *		Makefile), writing to it does not disable any irqs.
  *		@param buf		buffer
  *		@param size		number of bytes to write
  *		@return			number of bytes written
@@ -26,6 +47,20 @@ bool uart_init();
 uint16 uart_write(uint8 *buf, uint16 size);
 
 
+/**
+ *		write realtime bytes to the uart device.
+ *
+ *		the bytes go into a separate queue that is sent ahead of the 
+ *		output queue (but after priority-writes), so they don't have to 
+ *		wait for bytes written with uart_write() before. the bytes are 
+ *		not escaped, null-bytes and backslashes are skipped.
+ *		@param buf		buffer
+ *		@param size		number of bytes to write
+ *		@return			number of bytes consumed from buf
+ */
+uint16 uart_write_rt(uint8 *buf, uint16 size);
+
+
 /**
  *		send a string over the uart device.
  *
@@ -60,9 +95,21 @@ void uart_flush();
 uint16 uart_available();
 
 
+/**
+ *		return the free space in the output queue.
+ *
+ *		null-bytes and backslashes take two bytes each once escaped.
+ *		@return			number of bytes uart_write() can queue right now
+ */
+uint16 uart_writable();
+
+
 /**
  *		read from the uart device.
  *
+ *		the input queue is a ring buffer of UART_IN_SIZE bytes (see 
+ *		Makefile), reading from it does not disable any irqs. bytes 
+ *		arriving while the queue is full are dropped.
  *		@param dest		destination buffer
  *		@param size		size of destination buffer
  *		@return			number of bytes copied to destination buffer
@@ -70,6 +117,28 @@ uint16 uart_available();
 uint16 uart_read(uint8 *dest, uint16 size);
 
 
+/**
+ *		get direct access to the input queue.
+ *
+ *		points buf at the oldest byte in the input queue and returns the 
+ *		number of bytes that can be read from there without wrapping 
+ *		around. the bytes stay in the queue until uart_skip() is called, 
+ *		so they can be processed without copying them first.
+ *		@param buf		set to the first byte available for reading
+ *		@return			number of contiguous bytes available at buf
+ */
+uint16 uart_peek(uint8 **buf);
+
+
+/**
+ *		remove bytes from the head of the input queue.
+ *
+ *		@param size		number of bytes to remove (at most the number 
+ *						returned by uart_peek())
+ */
+void uart_skip(uint16 size);
+
+
 /**
  *		read a string from the uart device.
  *
@@ -128,16 +197,56 @@ void uart_set_bps(uint32 bps);
 
 
 /**
- *		set the baudrate to use for sending bytes over the spi bus.
+ *		set a fixed baudrate to use for sending bytes over the spi bus.
  *
- *		this function adjusts the internal timer frequency. the default 
- *		baudrate is being defined by UART_SPI_RATE in uart.c (100Hz at 
- *		the moment).
+ *		this function adjusts the internal timer frequency and turns off 
+ *		the adaptive rate (see uart_set_spi_rates()).
  *		@param bps		baudrate (bytes per second)
  */
 void uart_set_spi_rate(uint32 bps);
 
 
+/**
+ *		set the timer rates to use for exchanging bytes over the spi bus.
+ *
+ *		the timer runs at the busy rate while bytes are being sent or 
+ *		received and falls back to the idle rate after UART_SPI_IDLE_MS 
+ *		(50ms) without any. queueing bytes and card line irqs switch 
+ *		back to the busy rate right away. the defaults are defined by 
+ *		UART_SPI_RATE_IDLE and UART_SPI_RATE in uart.c (100 and 1000 
+ *		at the moment). while there are bytes to exchange, every timer 
+ *		irq moves up to UART_SPI_BURST (8) of them with chip select held, 
+ *		so the byte rate can be a multiple of the irq rate: at 1000 irqs 
+ *		that is 8000 bytes per second, enough for 31250 baud MIDI with 
+ *		every byte escaped.
+ *		@param idle		timer irqs per second while idle
+ *		@param busy		timer irqs per second while busy
+ */
+void uart_set_spi_rates(uint32 idle, uint32 busy);
+
+
+/**
+ *		set a function to be called when bytes have been received.
+ *
+ *		the handler is called from the timer or card line irq after new 
+ *		bytes have been put into the input queue. it then is the reader 
+ *		of the input queue, the main thread must not read from it.
+ *		@param handler	function to call, or NULL to turn off
+ */
+void uart_set_receive_handler(void (*handler)(void));
+
+
+/**
+ *		set a function to be called when the output queue has room.
+ *
+ *		the handler is called from the timer or card line irq whenever 
+ *		the output queue is at most half full, so bytes kept elsewhere 
+ *		can be moved over with uart_write() without polling for it.
+ *		@param handler	function to call, or NULL to turn off
+ */
+void uart_set_send_handler(void (*handler)(void));
+
+
 /**
  *		set watermarks.
  *
@@ -155,17 +264,28 @@ void uart_set_watermarks(uint16 high, uint16 low);
 /**
  *		get the effective baudrate used for sending bytes over the spi bus.
  *
+ *		with the adaptive rate this is the rate the timer runs at right 
+ *		now.
  *		@return			baudrate (bytes per second)
  */
 float uart_get_spi_rate();
 
 
+/**
+ *		get the number of irqs taken since uart_init().
+ *
+ *		@param timer_count	set to the number of timer irqs (can be NULL)
+ *		@param line_count	set to the number of card line irqs (can be NULL)
+ */
+void uart_get_irq_count(uint32 *timer_count, uint32 *line_count);
+
+
 /**
  *		do a priority-write to the uart device.
  *
- *		the content of buf are added to the head of the output queue, 
- *		and are guaranteed to fit in there (as other bytes are being 
- *		descarded to make some room). the content is also not being 
+ *		the content of buf (up to 8 bytes) is put into a separate 
+ *		priority buffer that is sent ahead of the output queue, so no 
+ *		bytes already queued are lost. the content is also not being 
  *		escapted and the response to each byte stored in the dest buffer 
  *		(which can be the same as buf). additionally, irq_bytes holds a 
  *		bitmask for which bytes the library should way for an irq from 
@@ -33,6 +33,14 @@
 
 static CARD_SPI_SETTINGS card_spi_settings;
 
+static CARD_SPI_XFER * volatile xfer_head = NULL;	/* transfer in progress or next */
+static CARD_SPI_XFER *xfer_tail = NULL;
+static volatile uint16 xfer_pos = 0;					/* bytes sent of xfer_head */
+static uint16 xfer_total = 0;
+static volatile uint8 spi_locked = 0;				/* lock depth */
+static int spi_lock_ime;							/* IME before the outermost lock */
+static int8 async_timer = -1;
+
 /*-------------------------------------------------------------------------------*/
 bool cardSpiBusy() {
 /*-------------------------------------------------------------------------------*/
@@ -75,6 +83,9 @@ void cardSpiSetHandler(void (*irqHandler)(void)) {
 /*-------------------------------------------------------------------------------*/
 char cardSpiTransfer(char c) {
 /*-------------------------------------------------------------------------------*/
+	char in;
+
+	cardSpiLock();
 	cardSpiStart(false);			/* enable card SPI */
 
 	REG_AUXSPIDATA = c;				/* send charactr */
@@ -88,7 +99,9 @@ char cardSpiTransfer(char c) {
 	swiDelay(12);
 #endif
 
-	return REG_AUXSPIDATA;
+	in = REG_AUXSPIDATA;
+	cardSpiUnlock();
+	return in;
 }
 
 /*-------------------------------------------------------------------------------*/
@@ -103,6 +116,8 @@ void cardSpiTransferBuffer(char *out, char *in, uint16 count) {
 		return;
 	}
 
+	cardSpiLock();
+
 	/* enable card SPI with CS hold */
 	cardSpiStart(true);
 
@@ -127,6 +142,8 @@ void cardSpiTransferBuffer(char *out, char *in, uint16 count) {
 #else
 	swiDelay(12);
 #endif
+
+	cardSpiUnlock();
 }
 
 /*-------------------------------------------------------------------------------*/
@@ -141,6 +158,8 @@ void cardSpiWriteBuffer(char *out, uint16 count) {
 		return;
 	}
 
+	cardSpiLock();
+
 	/* enable card SPI with CS hold */
 	cardSpiStart(true);
 
@@ -163,4 +182,176 @@ void cardSpiWriteBuffer(char *out, uint16 count) {
 #else
 	swiDelay(12);
 #endif
+
+	cardSpiUnlock();
+}
+
+/* Asynchronous transfers */
+
+/*-------------------------------------------------------------------------------*/
+static bool cardSpiAsyncStep() {
+/*-------------------------------------------------------------------------------*/
+	CARD_SPI_XFER *xfer = xfer_head;
+	uint16 pos = xfer_pos;
+	uint8 extra;
+	char c;
+
+	if (pos > 0) {
+		if (cardSpiBusy()) {
+			return false;			/* try again on the next tick */
+		}
+		c = REG_AUXSPIDATA;			/* receive character */
+		if (xfer->in != NULL) {
+			xfer->in[pos-1] = c;
+		}
+		if (xfer->sized && pos == xfer->count) {
+			extra = c;
+			xfer_total = xfer->count + (extra < xfer->sized ? extra : xfer->sized);
+		}
+	}
+
+	if (pos == xfer_total) {
+		/* disable card SPI, the next transfer starts on the next tick */
+		cardSpiStop();
+		xfer->received = xfer_total;
+
+		xfer_head = xfer->next;
+		if (xfer_head == NULL) {
+			xfer_tail = NULL;
+		} else {
+			xfer_total = xfer_head->count;
+		}
+		xfer_pos = 0;
+
+		if (xfer->done != NULL) {
+			xfer->done(xfer);
+		}
+		return false;
+	}
+
+	/* chip select is held up to the last character, and over a size byte */
+	cardSpiStart(pos < xfer_total - 1 || (xfer->sized && pos < xfer->count));
+	REG_AUXSPIDATA = (xfer->out != NULL && pos < xfer->count) ? xfer->out[pos] : 0;
+	xfer_pos = pos + 1;
+	return true;
+}
+
+/*-------------------------------------------------------------------------------*/
+static void cardSpiAsyncTick() {
+/*-------------------------------------------------------------------------------*/
+	uint8 n;
+
+	if (xfer_head == NULL) {
+		irqDisable((IRQ_MASK)BIT(async_timer+3));	/* idle until the next submit */
+		return;
+	}
+	if (spi_locked) {
+		return;
+	}
+	/* the bytes of a burst follow each other, the last one is received
+	   on the next tick */
+	for (n = 1; cardSpiAsyncStep() && n < CARD_SPI_ASYNC_BURST; n++) {
+		while(cardSpiBusy());	/* busy wait, one character */
+	}
+}
+
+/*-------------------------------------------------------------------------------*/
+bool cardSpiAsyncInit(uint32 rate) {
+/*-------------------------------------------------------------------------------*/
+	int8 i;
+
+	if (async_timer >= 0) {
+		return true;
+	}
+
+	/* TIMER3 belongs to the wifi library */
+	for (i = 2; i >= 0; i--) {
+		if (!(TIMER_CR(i) & TIMER_ENABLE)) {
+			async_timer = i;
+			break;
+		}
+	}
+	if (async_timer < 0) {
+		return false;
+	}
+
+	/* the timer keeps running so it stays taken, only its IRQ is switched */
+	irqSet((IRQ_MASK)BIT(async_timer+3), cardSpiAsyncTick);
+	irqDisable((IRQ_MASK)BIT(async_timer+3));
+	TIMER_DATA(async_timer) = timerFreqToTicks_1(rate);
+	TIMER_CR(async_timer) = TIMER_DIV_1 | TIMER_IRQ_REQ | TIMER_ENABLE;
+
+	return true;
+}
+
+/*-------------------------------------------------------------------------------*/
+bool cardSpiAsyncRunning() {
+/*-------------------------------------------------------------------------------*/
+	return async_timer >= 0;
+}
+
+/*-------------------------------------------------------------------------------*/
+bool cardSpiAsyncSubmit(CARD_SPI_XFER *xfer) {
+/*-------------------------------------------------------------------------------*/
+	int oldIME;
+
+	if (async_timer < 0 || xfer->count == 0) {
+		return false;
+	}
+
+	xfer->next = NULL;
+	xfer->received = 0;
+
+	oldIME = enterCriticalSection();
+	if (xfer_tail == NULL) {
+		xfer_head = xfer;
+		xfer_total = xfer->count;
+		xfer_pos = 0;
+	} else {
+		xfer_tail->next = xfer;
+	}
+	xfer_tail = xfer;
+	irqEnable((IRQ_MASK)BIT(async_timer+3));
+	leaveCriticalSection(oldIME);
+
+	return true;
+}
+
+/*-------------------------------------------------------------------------------*/
+bool cardSpiAsyncBusy() {
+/*-------------------------------------------------------------------------------*/
+	return xfer_head != NULL;
+}
+
+/*-------------------------------------------------------------------------------*/
+void cardSpiLock() {
+/*-------------------------------------------------------------------------------*/
+	int oldIME;
+
+	/* interrupts stay off until the outermost unlock, so nothing else can
+	   clock bytes into the transfer; nested locks can only come from the
+	   holder */
+	oldIME = enterCriticalSection();
+	if (spi_locked) {
+		spi_locked++;
+		return;
+	}
+
+	/* a transfer in progress is finished first, queued transfers that have
+	   not started wait for the unlock */
+	if (async_timer >= 0) {
+		while (xfer_head != NULL && xfer_pos != 0) {
+			cardSpiAsyncStep();
+		}
+	}
+	spi_locked = 1;
+	spi_lock_ime = oldIME;
+}
+
+/*-------------------------------------------------------------------------------*/
+void cardSpiUnlock() {
+/*-------------------------------------------------------------------------------*/
+	if (spi_locked && --spi_locked == 0) {
+		leaveCriticalSection(spi_lock_ime);
+	}
 }
@@ -49,6 +49,19 @@ static void (*dseUart0ReceiveHandler)(char * data, unsigned int size);
 static void (*dseUart0SendHandler)(void);
 static void (*dseUart1ReceiveHandler)(char * data, unsigned int size);
 static void (*dseUart1SendHandler)(void);
+static void (*dseProgressHandler)(unsigned int done, unsigned int total);
+
+static bool AsyncMode;
+static void dseAsyncReadInterrupts();
+static int dseQueuedTransfer(char * out, uint8 count, uint8 sized, char * in);
+
+/* Shadows of the port registers. Only this file writes them, so each port is
+   read once after dseInit and from then on set from the shadow. ShadowP holds
+   the output latch, reading MCU_Px still returns the pin levels. */
+static uint8 ShadowP[4], ShadowMdin[4], ShadowMdout[4], ShadowSkip[4];
+static uint8 ShadowValid;			/* bit per port, shadow loaded */
+static uint8 PortDirty;				/* bit per port, latch not written yet */
+static bool PortBatch;				/* latch writes wait for dsePortFlush */
 
 /* Helpers */
 
@@ -59,6 +72,11 @@ void dseIrqHandler() {
 	uint8 size;
 	bool stopFlashing = false;
 
+	if (AsyncMode) {
+		dseAsyncReadInterrupts();
+		return;
+	}
+
 	/* read interrupt flags */
 	size = dseReadBuffer(SELECT_INTERRUPT, buffer);
 
@@ -121,14 +139,32 @@ void dseWriteBuffer(uint8 selector, uint8 size, char * data) {
 	buffer[1] = size;
 	memcpy(buffer + 2, data, size);
 
+	if (dseQueuedTransfer(buffer, size+2, 0, NULL) >= 0) {
+		return;
+	}
 	cardSpiWriteBuffer(buffer, size+2);
 }
 
 /*-------------------------------------------------------------------------------*/
 uint8 dseReadBuffer(uint8 selector, char * data) {
 /*-------------------------------------------------------------------------------*/
+	char buffer[MAX_DATA_SIZE+3];
+	int received;
 	uint8 size, i;
 
+	buffer[0] = SELECT_READ | selector;
+	buffer[1] = buffer[2] = 0;
+	received = dseQueuedTransfer(buffer, 3, MAX_DATA_SIZE, buffer);
+	if (received >= 3) {
+		size = buffer[2];
+		if (size <= MAX_DATA_SIZE) {
+			memcpy(data, buffer + 3, received - 3);
+		}
+		return size;
+	}
+
+	cardSpiLock();
+
 	/* enable card SPI with CS hold */
 	cardSpiStart(true);
 
@@ -166,6 +202,8 @@ uint8 dseReadBuffer(uint8 selector, char * data) {
 	swiDelay(12);
 #endif
 
+	cardSpiUnlock();
+
 	return size;
 }
 
@@ -178,6 +216,8 @@ bool dseReadFlash(char * data, uint16 pos, uint8 size) {
 		return false;
 	}
 
+	cardSpiLock();
+
 	/* enable card SPI with CS hold */
 	cardSpiStart(true);
 
@@ -217,6 +257,8 @@ bool dseReadFlash(char * data, uint16 pos, uint8 size) {
 	swiDelay(12);
 #endif
 
+	cardSpiUnlock();
+
 	return true;
 }
 
@@ -232,8 +274,19 @@ void dseWriteRegister(uint8 reg, uint8 val) {
 /*-------------------------------------------------------------------------------*/
 uint8 dseReadRegister(uint8 reg) {
 /*-------------------------------------------------------------------------------*/
+	char buffer[4];
 	uint8 val;
 
+	/* the value comes with the last character */
+	buffer[0] = SELECT_READ | SELECT_REGISTER;
+	buffer[1] = reg;
+	buffer[2] = buffer[3] = 0;
+	if (dseQueuedTransfer(buffer, 4, 0, buffer) >= 0) {
+		return buffer[3];
+	}
+
+	cardSpiLock();
+
 	/* enable card SPI with CS hold */
 	cardSpiStart(true);
 
@@ -260,9 +313,331 @@ uint8 dseReadRegister(uint8 reg) {
 	swiDelay(12);
 #endif
 
+	cardSpiUnlock();
+
 	return val;
 }
 
+/* Asynchronous access */
+
+/* Requests carry an asynchronous transfer with its buffers and what to do
+   when it is done. They come from a small pool, as they are also needed in
+   interrupts. */
+#define DSE_REQUESTS	16
+
+typedef struct DseRequest {
+	CARD_SPI_XFER xfer;				/* first, so the transfer is the request */
+	char out[MAX_DATA_SIZE+2];
+	char in[MAX_DATA_SIZE+3];
+	void (*step)(struct DseRequest *req);	/* runs when the transfer is done */
+	union {
+		void (*reg)(uint8 val, void *user);
+		void (*pin)(bool state, void *user);
+		void (*analog)(uint16 val, void *user);
+		void (*analogAll)(uint8 count, void *user);
+	} handler;
+	void *user;
+	uint16 *values;
+	uint8 port;
+	uint8 pin;
+	volatile bool used;
+} DseRequest;
+
+/* received data of a read request */
+#define REQUEST_DATA(req)	((req)->in + 3)
+#define REQUEST_SIZE(req)	((req)->xfer.received - 3)
+
+static DseRequest Requests[DSE_REQUESTS];
+static volatile bool IrqPending;	/* interrupt flags are being read and handled */
+static volatile bool IrqAgain;		/* the card interrupted again meanwhile */
+
+/*-------------------------------------------------------------------------------*/
+static DseRequest * dseRequestAlloc() {
+/*-------------------------------------------------------------------------------*/
+	DseRequest *req = NULL;
+	int oldIME, i;
+
+	oldIME = enterCriticalSection();
+	for (i = 0; i < DSE_REQUESTS; i++) {
+		if (!Requests[i].used) {
+			req = &Requests[i];
+			req->used = true;
+			break;
+		}
+	}
+	leaveCriticalSection(oldIME);
+
+	return req;
+}
+
+/*-------------------------------------------------------------------------------*/
+static void dseRequestDone(CARD_SPI_XFER *xfer) {
+/*-------------------------------------------------------------------------------*/
+	DseRequest *req = (DseRequest *) xfer;
+
+	if (req->step != NULL) {
+		req->step(req);
+	}
+	req->used = false;
+}
+
+/*-------------------------------------------------------------------------------*/
+static DseRequest * dsePrepareWrite(uint8 selector, uint8 size, char * data) {
+/*-------------------------------------------------------------------------------*/
+	DseRequest *req = dseRequestAlloc();
+
+	if (req != NULL) {
+		req->out[0] = SELECT_WRITE | selector;
+		req->out[1] = size;
+		memcpy(req->out + 2, data, size);
+		req->xfer.count = size + 2;
+		req->xfer.sized = 0;
+	}
+	return req;
+}
+
+/*-------------------------------------------------------------------------------*/
+static DseRequest * dsePrepareRead(uint8 selector) {
+/*-------------------------------------------------------------------------------*/
+	DseRequest *req = dseRequestAlloc();
+
+	if (req != NULL) {
+		req->out[0] = SELECT_READ | selector;
+		req->out[1] = 0;
+		req->out[2] = 0;
+		req->xfer.count = 3;
+		req->xfer.sized = MAX_DATA_SIZE;	/* third byte is the size */
+	}
+	return req;
+}
+
+/*-------------------------------------------------------------------------------*/
+static bool dseSubmit(DseRequest *req, void (*step)(DseRequest *req)) {
+/*-------------------------------------------------------------------------------*/
+	req->xfer.out = req->out;
+	req->xfer.in = req->in;
+	req->xfer.done = dseRequestDone;
+	req->step = step;
+
+	if (!cardSpiAsyncSubmit(&req->xfer)) {
+		req->used = false;
+		return false;
+	}
+	return true;
+}
+
+/* In async mode the synchronous calls queue their transfer behind the
+   others and wait for it with interrupts enabled, instead of locking the
+   bus. In interrupts and critical sections the queue doesn't move, there
+   (and when no request is free) they lock the bus as before. */
+
+typedef struct {
+	char *in;
+	int received;
+	volatile bool done;
+} DseWaiter;
+
+/*-------------------------------------------------------------------------------*/
+static void dseAsyncWaited(DseRequest *req) {
+/*-------------------------------------------------------------------------------*/
+	DseWaiter *waiter = (DseWaiter *) req->user;
+
+	/* the request is reused once this returns */
+	if (waiter->in != NULL) {
+		memcpy(waiter->in, req->in, req->xfer.received);
+	}
+	waiter->received = req->xfer.received;
+	waiter->done = true;
+}
+
+/*-------------------------------------------------------------------------------*/
+static int dseQueuedTransfer(char * out, uint8 count, uint8 sized, char * in) {
+/*-------------------------------------------------------------------------------*/
+	DseWaiter waiter;
+	DseRequest *req;
+
+	if (!AsyncMode || REG_IME == 0) {
+		return -1;
+	}
+
+	req = dseRequestAlloc();
+	if (req == NULL) {
+		return -1;
+	}
+	memcpy(req->out, out, count);
+	req->xfer.count = count;
+	req->xfer.sized = sized;
+	waiter.in = in;
+	waiter.done = false;
+	req->user = &waiter;
+	if (!dseSubmit(req, dseAsyncWaited)) {
+		return -1;
+	}
+
+	while(!waiter.done);	/* the transfer runs from the timer interrupt */
+	return waiter.received;
+}
+
+/*-------------------------------------------------------------------------------*/
+static void dseAsyncUartReceived(DseRequest *req) {
+/*-------------------------------------------------------------------------------*/
+	void (*handler)(char * data, unsigned int size);
+
+	handler = req->port == UART0 ? dseUart0ReceiveHandler : dseUart1ReceiveHandler;
+	if (handler != NULL) {
+		handler(REQUEST_DATA(req), REQUEST_SIZE(req));
+	}
+}
+
+/*-------------------------------------------------------------------------------*/
+static void dseAsyncIrqAcked(DseRequest *req) {
+/*-------------------------------------------------------------------------------*/
+	if (req->out[2] & INTERRUPT_BOOTLOADER) {
+		Flashing = false;
+	}
+
+	IrqPending = false;
+	if (IrqAgain) {
+		IrqAgain = false;
+		dseAsyncReadInterrupts();
+	}
+}
+
+/*-------------------------------------------------------------------------------*/
+static void dseAsyncIrqFlags(DseRequest *req) {
+/*-------------------------------------------------------------------------------*/
+	char flags = REQUEST_SIZE(req) > 0 ? REQUEST_DATA(req)[0] : 0;
+	DseRequest *next;
+
+	/* same order as dseIrqHandler, the buffer reads are queued before the ack */
+
+	if (flags & INTERRUPT_UART0_TX) {
+		UartSending[0] = false;
+		if (dseUart0SendHandler != NULL) {
+			dseUart0SendHandler();
+		}
+	}
+
+	if (flags & INTERRUPT_UART0_RX) {
+		next = dsePrepareRead(SELECT_UART0_BUFFER);
+		if (next != NULL) {
+			next->port = UART0;
+			dseSubmit(next, dseAsyncUartReceived);
+		}
+	}
+
+	if (flags & INTERRUPT_UART1_TX) {
+		UartSending[1] = false;
+		if (dseUart1SendHandler != NULL) {
+			dseUart1SendHandler();
+		}
+	}
+
+	if (flags & INTERRUPT_UART1_RX) {
+		next = dsePrepareRead(SELECT_UART1_BUFFER);
+		if (next != NULL) {
+			next->port = UART1;
+			dseSubmit(next, dseAsyncUartReceived);
+		}
+	}
+
+	/* ack interupts */
+	next = dsePrepareWrite(SELECT_INTERRUPT, 1, &flags);
+	if (next == NULL || !dseSubmit(next, dseAsyncIrqAcked)) {
+		IrqPending = false;
+	}
+}
+
+/*-------------------------------------------------------------------------------*/
+static void dseAsyncReadInterrupts() {
+/*-------------------------------------------------------------------------------*/
+	DseRequest *req;
+
+	if (IrqPending) {
+		IrqAgain = true;
+		return;
+	}
+
+	req = dsePrepareRead(SELECT_INTERRUPT);
+	if (req == NULL) {
+		return;
+	}
+	IrqPending = true;
+	if (!dseSubmit(req, dseAsyncIrqFlags)) {
+		IrqPending = false;
+	}
+}
+
+/*-------------------------------------------------------------------------------*/
+bool dseAsyncInit() {
+/*-------------------------------------------------------------------------------*/
+	/* from here on the card interrupt, UART sends and the *Async calls
+	   queue their transfers instead of busy waiting */
+	if (!cardSpiAsyncInit(CARD_SPI_ASYNC_RATE)) {
+		return false;
+	}
+	AsyncMode = true;
+	return true;
+}
+
+/*-------------------------------------------------------------------------------*/
+bool dseWriteRegisterAsync(uint8 reg, uint8 val) {
+/*-------------------------------------------------------------------------------*/
+	char buffer[2];
+	DseRequest *req;
+
+	if (!AsyncMode) {
+		dseWriteRegister(reg, val);
+		return true;
+	}
+
+	buffer[0] = reg;
+	buffer[1] = val;
+	req = dsePrepareWrite(SELECT_REGISTER, 2, buffer);
+	return req != NULL && dseSubmit(req, NULL);
+}
+
+/*-------------------------------------------------------------------------------*/
+static DseRequest * dsePrepareRegisterRead(uint8 reg) {
+/*-------------------------------------------------------------------------------*/
+	DseRequest *req = dseRequestAlloc();
+
+	/* like dseReadRegister, the value comes with the last character */
+	if (req != NULL) {
+		req->out[0] = SELECT_READ | SELECT_REGISTER;
+		req->out[1] = reg;
+		req->out[2] = 0;
+		req->out[3] = 0;
+		req->xfer.count = 4;
+		req->xfer.sized = 0;
+	}
+	return req;
+}
+
+/*-------------------------------------------------------------------------------*/
+static void dseAsyncRegisterRead(DseRequest *req) {
+/*-------------------------------------------------------------------------------*/
+	req->handler.reg(req->in[3], req->user);
+}
+
+/*-------------------------------------------------------------------------------*/
+bool dseReadRegisterAsync(uint8 reg, void (*handler)(uint8 val, void *user), void *user) {
+/*-------------------------------------------------------------------------------*/
+	DseRequest *req;
+
+	if (!AsyncMode) {
+		return false;
+	}
+
+	req = dsePrepareRegisterRead(reg);
+	if (req == NULL) {
+		return false;
+	}
+	req->handler.reg = handler;
+	req->user = user;
+	return dseSubmit(req, dseAsyncRegisterRead);
+}
+
 /* Configuration */
 
 /*-------------------------------------------------------------------------------*/
@@ -270,6 +645,10 @@ bool dseInit() {
 /*-------------------------------------------------------------------------------*/
 	Flashing = false;
 	UartSending[0] = UartSending[1] = false;
+	AsyncMode = false;
+	IrqPending = IrqAgain = false;
+	ShadowValid = PortDirty = 0;
+	PortBatch = false;
 
 	cardSpiInit(CLOCK_512KHZ);
 
@@ -328,66 +707,280 @@ int dseVersion() {
 	return size == 1 ? buffer[0] : 0;
 }
 
+/* Firmware stamp */
+
+/* A stamp {magic, size, crc32} is written right after the firmware when it
+   was uploaded or verified, so that matching it only takes one short read. */
+#define FIRMWARE_START			0x0800
+#define FIRMWARE_PAGE_SIZE		512
+#define FIRMWARE_STAMP_MAGIC	0x494D5344	/* "DSMI" */
+#define FIRMWARE_STAMP_SIZE		12
+
+static const uint32 Crc32Nibble[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
 /*-------------------------------------------------------------------------------*/
-bool dseUploadFirmware(char * fwdata, unsigned int fwsize) {
+static uint32 dseCrc32(char * data, unsigned int size) {
+/*-------------------------------------------------------------------------------*/
+	uint32 crc = 0xFFFFFFFF;
+	unsigned int i;
+	uint8 byte;
+
+	for (i = 0; i < size; i++) {
+		byte = data[i];
+		crc = Crc32Nibble[(crc ^ byte) & 0x0F] ^ (crc >> 4);
+		crc = Crc32Nibble[(crc ^ (byte >> 4)) & 0x0F] ^ (crc >> 4);
+	}
+	return ~crc;
+}
+
+/*-------------------------------------------------------------------------------*/
+static uint16 dseStampLocation(unsigned int fwsize) {
+/*-------------------------------------------------------------------------------*/
+	/* the first flash block after the firmware */
+	return FIRMWARE_START + ((fwsize + MAX_DATA_SIZE - 1) & ~(MAX_DATA_SIZE - 1));
+}
+
+/*-------------------------------------------------------------------------------*/
+static void dseMakeStamp(char * stamp, char * data, unsigned int fwsize) {
+/*-------------------------------------------------------------------------------*/
+	uint32 words[3];
+	int i;
+
+	words[0] = FIRMWARE_STAMP_MAGIC;
+	words[1] = fwsize;
+	words[2] = dseCrc32(data, fwsize);
+
+	/* little endian, whatever the host */
+	for (i = 0; i < FIRMWARE_STAMP_SIZE; i++) {
+		stamp[i] = words[i / 4] >> ((i % 4) * 8);
+	}
+}
+
+/* The flash is only written by firmware updates, which run between dseInit
+   and dseAsyncInit; the waits are for the MCU's interrupt when it is done. */
+
+/*-------------------------------------------------------------------------------*/
+static void dseEraseFlash(uint16 loc) {
+/*-------------------------------------------------------------------------------*/
+	char temp[2];
+	temp[0] = loc >> 8;
+	temp[1] = loc & 0xFF;
+	Flashing = true;
+	dseWriteBuffer(SELECT_FLASH_ERASE, 2, temp);
+	while(Flashing); /* busy wait */
+}
+
+/*-------------------------------------------------------------------------------*/
+static void dseWriteFlash(uint16 loc, char * data, uint8 size) {
+/*-------------------------------------------------------------------------------*/
+	char buffer[MAX_DATA_SIZE+2];
+	buffer[0] = loc >> 8;
+	buffer[1] = loc & 0xFF;
+	memcpy(buffer+2, data, size);
+	Flashing = true;
+	dseWriteBuffer(SELECT_FLASH, size+2, buffer);
+	while(Flashing); /* busy wait */
+}
+
+/*-------------------------------------------------------------------------------*/
+bool dseMatchFirmwareStamp(char * data, unsigned int fwsize) {
+/*-------------------------------------------------------------------------------*/
+	char expected[FIRMWARE_STAMP_SIZE];
+	char stamp[FIRMWARE_STAMP_SIZE];
+
+	dseMakeStamp(expected, data, fwsize);
+	dseReadFlash(stamp, dseStampLocation(fwsize), FIRMWARE_STAMP_SIZE);
+
+	return memcmp(stamp, expected, FIRMWARE_STAMP_SIZE) == 0;
+}
+
+/*-------------------------------------------------------------------------------*/
+static bool dseWriteFirmwareStamp(char * data, unsigned int fwsize) {
+/*-------------------------------------------------------------------------------*/
+	uint16 loc = dseStampLocation(fwsize);
+	char stamp[FIRMWARE_STAMP_SIZE];
+	int i;
+
+	/* flash can only be programmed when erased, and only a page of its own
+	   can be erased without touching the firmware */
+	dseReadFlash(stamp, loc, FIRMWARE_STAMP_SIZE);
+	for (i = 0; i < FIRMWARE_STAMP_SIZE && stamp[i] == (char)0xFF; i++);
+	if (i < FIRMWARE_STAMP_SIZE) {
+		if ((loc - FIRMWARE_START) % FIRMWARE_PAGE_SIZE != 0) {
+			return false;
+		}
+		dseEraseFlash(loc);
+	}
+
+	dseMakeStamp(stamp, data, fwsize);
+	dseWriteFlash(loc, stamp, FIRMWARE_STAMP_SIZE);
+	return true;
+}
+
+/*-------------------------------------------------------------------------------*/
+static void dseInvalidateStamp(unsigned int fwsize) {
+/*-------------------------------------------------------------------------------*/
+	/* programming only clears bits, so zeros can always be written */
+	char zeros[FIRMWARE_STAMP_SIZE];
+	memset(zeros, 0, FIRMWARE_STAMP_SIZE);
+	dseWriteFlash(dseStampLocation(fwsize), zeros, FIRMWARE_STAMP_SIZE);
+}
+
+/*-------------------------------------------------------------------------------*/
+static bool dseMatchFlash(uint16 pos, char * data, unsigned int size) {
+/*-------------------------------------------------------------------------------*/
+	char buffer[MAX_DATA_SIZE];
+	unsigned int i;
+	uint8 block;
+
+	for (i = 0; i < size; i += MAX_DATA_SIZE) {
+		block = (i + MAX_DATA_SIZE <= size) ? MAX_DATA_SIZE : (size - i);
+		dseReadFlash(buffer, FIRMWARE_START + pos + i, block);
+		if (memcmp(data + i, buffer, block) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*-------------------------------------------------------------------------------*/
+static void dseFlashPage(uint16 pos, char * fwdata, unsigned int fwsize) {
 /*-------------------------------------------------------------------------------*/
 	const uint8 BLOCK_SIZE = 32; /* max 32 */
-	uint16 pos, loc;
+	uint16 end = (pos + FIRMWARE_PAGE_SIZE <= fwsize) ? pos + FIRMWARE_PAGE_SIZE : fwsize;
 	uint8 size;
-	char buffer[BLOCK_SIZE+2];
-
-	for (pos = 0; pos < fwsize; pos += BLOCK_SIZE) {
-		size = (pos + BLOCK_SIZE <= fwsize) ? BLOCK_SIZE : (fwsize - pos);
-		//iprintf("<%i%%>\n", pos * 100 / fwsize); /* show percentage */
-
-		loc = 0x0800 + pos;
-
-		if (pos % 512 == 0) {
-			char temp[2];
-			temp[0] = loc >> 8;
-			temp[1] = loc & 0xFF;
-			Flashing = true;
-			//iprintf("(");
-			dseWriteBuffer(SELECT_FLASH_ERASE, 2, temp);
-			while(Flashing); /* busy wait */
-			//iprintf(")");
-		}
 
-		buffer[0] = loc >> 8;
-		buffer[1] = loc & 0xFF;
-		memcpy(buffer+2, &(fwdata[pos]), size);
-		Flashing = true;
-		//iprintf("<");
-		dseWriteBuffer(SELECT_FLASH, size+2, buffer);
-		while(Flashing); /* busy wait */
-		//iprintf(">");
+	dseEraseFlash(FIRMWARE_START + pos);
+	for (; pos < end; pos += BLOCK_SIZE) {
+		size = (pos + BLOCK_SIZE <= end) ? BLOCK_SIZE : (end - pos);
+		dseWriteFlash(FIRMWARE_START + pos, &(fwdata[pos]), size);
 	}
+}
 
-	return true;
+/*-------------------------------------------------------------------------------*/
+void dseSetProgressHandler(void (*progressHandler)(unsigned int done, unsigned int total)) {
+/*-------------------------------------------------------------------------------*/
+	dseProgressHandler = progressHandler;
 }
 
 /*-------------------------------------------------------------------------------*/
-bool dseMatchFirmware(char * data, unsigned int fwsize) {
+bool dseUploadFirmware(char * fwdata, unsigned int fwsize) {
 /*-------------------------------------------------------------------------------*/
-	const uint8 BLOCK_SIZE = 16; /* max 32 */
-	uint16 i;
-	char buffer[BLOCK_SIZE];
+	uint16 pos, end;
+
+	/* an interrupted upload must not leave a valid stamp behind */
+	dseInvalidateStamp(fwsize);
 
-	iprintf("Firmware size is 0x%04X.\n", fwsize);
-	for (i = 0; i < fwsize; i++) {
-		uint16 pos = i % BLOCK_SIZE;
-		uint8 size = (i + BLOCK_SIZE <= fwsize) ? BLOCK_SIZE : (fwsize - i);
-		if (pos == 0) {
-			dseReadFlash(buffer, 0x0800 + i, size);
+	for (pos = 0; pos < fwsize; pos += FIRMWARE_PAGE_SIZE) {
+		dseFlashPage(pos, fwdata, fwsize);
+
+		end = (pos + FIRMWARE_PAGE_SIZE <= fwsize) ? pos + FIRMWARE_PAGE_SIZE : fwsize;
+		if (dseProgressHandler != NULL) {
+			dseProgressHandler(end, fwsize);
 		}
-		if (data[i] != buffer[pos]) {
-			iprintf("Difference at 0x%04X.\n", i);
-			return false;	/* firmwares do not match */
+	}
+
+	dseWriteFirmwareStamp(fwdata, fwsize);
+
+	return true;
+}
+
+/*-------------------------------------------------------------------------------*/
+bool dseUploadFirmwareDelta(char * fwdata, unsigned int fwsize) {
+/*-------------------------------------------------------------------------------*/
+	dseUpdateBegin(fwdata, fwsize);
+	while (dseUpdateStep() < fwsize);
+
+	return true;
+}
+
+/* Firmware update in steps */
+
+static char * UpdateData;
+static unsigned int UpdateSize;
+static uint16 UpdatePos;				/* bytes checked so far */
+static bool UpdateDirty;				/* a page was rewritten, the stamp is invalid */
+
+/*-------------------------------------------------------------------------------*/
+void dseUpdateBegin(char * fwdata, unsigned int fwsize) {
+/*-------------------------------------------------------------------------------*/
+	UpdateData = fwdata;
+	UpdateSize = fwsize;
+	UpdatePos = 0;
+	UpdateDirty = false;
+}
+
+/*-------------------------------------------------------------------------------*/
+unsigned int dseUpdateStep() {
+/*-------------------------------------------------------------------------------*/
+	uint16 stamp = dseStampLocation(UpdateSize) - FIRMWARE_START;
+	uint16 pos = UpdatePos;
+	uint16 end;
+	bool last, flash;
+
+	if (pos >= UpdateSize) {
+		return UpdateSize;
+	}
+
+	end = (pos + FIRMWARE_PAGE_SIZE <= UpdateSize) ? pos + FIRMWARE_PAGE_SIZE : UpdateSize;
+	last = end == UpdateSize;
+
+	/* nothing is touched until a page differs, then the stamp is
+	   invalidated first so an interrupted update can't leave it valid */
+	flash = !dseMatchFlash(pos, &(UpdateData[pos]), end - pos);
+	if (last && !flash && !UpdateDirty && !dseMatchFirmwareStamp(UpdateData, UpdateSize)
+		&& !dseWriteFirmwareStamp(UpdateData, UpdateSize)) {
+		flash = true;	/* the stamp could not be written in place */
+	}
+	if (last && UpdateDirty && stamp % FIRMWARE_PAGE_SIZE != 0) {
+		flash = true;	/* a stamp sharing the last page can only be written after erasing it */
+	}
+
+	if (flash) {
+		if (!UpdateDirty) {
+			dseInvalidateStamp(UpdateSize);
+			UpdateDirty = true;
 		}
+		dseFlashPage(pos, UpdateData, UpdateSize);
+	}
+
+	if (last && UpdateDirty) {
+		dseWriteFirmwareStamp(UpdateData, UpdateSize);
+	}
+
+	UpdatePos = end;
+	if (dseProgressHandler != NULL) {
+		dseProgressHandler(end, UpdateSize);
+	}
+
+	return end;
+}
+
+/*-------------------------------------------------------------------------------*/
+bool dseMatchFirmware(char * data, unsigned int fwsize) {
+/*-------------------------------------------------------------------------------*/
+	if (dseMatchFirmwareStamp(data, fwsize)) {
+		return true;
+	}
+
+	if (!dseVerifyFirmware(data, fwsize)) {
+		return false;	/* firmwares do not match */
 	}
+
+	/* the firmware is right but has no stamp yet, so next time is quick */
+	dseWriteFirmwareStamp(data, fwsize);
 	return true;			/* firmwares match */
 }
 
+/*-------------------------------------------------------------------------------*/
+bool dseVerifyFirmware(char * data, unsigned int fwsize) {
+/*-------------------------------------------------------------------------------*/
+	return dseMatchFlash(0, data, fwsize);
+}
+
 /*-------------------------------------------------------------------------------*/
 bool dseBoot() {
 /*-------------------------------------------------------------------------------*/
@@ -407,10 +1000,30 @@ void dseSetModes(unsigned char modes) {
 /*-------------------------------------------------------------------------------*/
 bool dseUartSendBuffer(DseUart uart, char * data, unsigned int size, bool blocking) {
 /*-------------------------------------------------------------------------------*/
+	DseRequest *req;
+
 	if (size > MAX_DATA_SIZE) {
 		return false;
 	}
 
+	if (AsyncMode) {
+		req = dsePrepareWrite(uart == UART0 ? SELECT_UART0_BUFFER : SELECT_UART1_BUFFER, size, data);
+		if (req == NULL) {
+			return false;
+		}
+		if (blocking) {
+			UartSending[uart] = true;
+		}
+		if (!dseSubmit(req, NULL)) {
+			UartSending[uart] = false;
+			return false;
+		}
+		if (blocking) {
+			while(UartSending[uart]); /* busy wait */
+		}
+		return true;
+	}
+
 	if (blocking) {
 		UartSending[uart] = true;
 	}
@@ -428,6 +1041,13 @@ bool dseUartSendBuffer(DseUart uart, char * data, unsigned int size, bool blocki
 	return true;
 }
 
+/*-------------------------------------------------------------------------------*/
+bool dseUartEnabled(DseUart uart) {
+/*-------------------------------------------------------------------------------*/
+	/* UART1 takes pins of port 2, only newer carts have it */
+	return uart <= UART1 && UartEnabled[uart];
+}
+
 /*-------------------------------------------------------------------------------*/
 void dseUartSetReceiveHandler(DseUart uart, void (*receiveHandler)(char * data, unsigned int size)) {
 /*-------------------------------------------------------------------------------*/
@@ -574,6 +1194,28 @@ const uint8 pin_mask[][4] = {{0xC0, 0xFF, 0xFF, 0x00},		/* GPIO pins when UART1
 const uint8 pin_adc_mask[][4] = {{0x00, 0xFF, 0xFF, 0x00},	/* ADC pins when UART1 disabled */
 								{0x00, 0xFF, 0x3F, 0x00}};	/* ADC pins when UART1 enabled */
 
+/*-------------------------------------------------------------------------------*/
+static void dseShadowLoad(uint8 port) {
+/*-------------------------------------------------------------------------------*/
+	if(ShadowValid & (1 << port)) {
+		return;
+	}
+	ShadowP[port] = dseReadRegister(pin_p[port]);
+	ShadowMdin[port] = dseReadRegister(pin_mdin[port]);
+	ShadowMdout[port] = dseReadRegister(pin_mdout[port]);
+	ShadowSkip[port] = dseReadRegister(pin_skip[port]);
+	ShadowValid |= 1 << port;
+}
+
+/*-------------------------------------------------------------------------------*/
+static void dseShadowWrite(uint8 reg, uint8 *shadow, uint8 value) {
+/*-------------------------------------------------------------------------------*/
+	if(*shadow != value) {
+		*shadow = value;
+		dseWriteRegister(reg, value);
+	}
+}
+
 /*-------------------------------------------------------------------------------*/
 void dsePinMode(DsePort port, uint8 pin, DsePinMode mode) {
 /*-------------------------------------------------------------------------------*/
@@ -584,11 +1226,12 @@ void dsePinMode(DsePort port, uint8 pin, DsePinMode mode) {
 		return;
 	}
 
-	uint8 skip = dseReadRegister(pin_skip[port]);
-	skip |= (1 << pin);			/* crossbar should skip pin */
-	dseWriteRegister(pin_skip[port], skip);
+	dseShadowLoad(port);
 
-	uint8 mdin = dseReadRegister(pin_mdin[port]);
+	/* crossbar should skip pin */
+	dseShadowWrite(pin_skip[port], &ShadowSkip[port], ShadowSkip[port] | (1 << pin));
+
+	uint8 mdin = ShadowMdin[port];
 
 	if(mode == ANALOG_INPUT) {		/* analog pin */
 		if(!AnalogPin[ANALOG_INDEX(port, pin)]) {
@@ -604,7 +1247,7 @@ void dsePinMode(DsePort port, uint8 pin, DsePinMode mode) {
 			dseAnalogPinsUpdate();
 		}
 
-		uint8 mdout = dseReadRegister(pin_mdout[port]);
+		uint8 mdout = ShadowMdout[port];
 		mdin |= (1 << pin);			/* not analog input */
 		
 		if(mode == INPUT) {
@@ -613,9 +1256,9 @@ void dsePinMode(DsePort port, uint8 pin, DsePinMode mode) {
 			mdout |= 1 << pin;		/* push-pull */
 		}
 		
-		dseWriteRegister(pin_mdout[port], mdout);
+		dseShadowWrite(pin_mdout[port], &ShadowMdout[port], mdout);
 	}
-	dseWriteRegister(pin_mdin[port], mdin);
+	dseShadowWrite(pin_mdin[port], &ShadowMdin[port], mdin);
 }
 
 /*-------------------------------------------------------------------------------*/
@@ -636,38 +1279,92 @@ void dsePinWrite(DsePort port, uint8 pin, bool state) {
 	if(pin > 7 || port > 3 || !(pin_mask[u][port] & (1 << pin))) {
 		return;
 	}
-	uint8 p = dseReadRegister(pin_p[port]);
-	if(state) {
-		p |= 1 << pin;
+	dsePortWrite(port, 1 << pin, state ? 0xFF : 0x00);
+}
+
+/*-------------------------------------------------------------------------------*/
+void dsePortWrite(DsePort port, uint8 mask, uint8 value) {
+/*-------------------------------------------------------------------------------*/
+	uint8 u = UartEnabled[1] ? 1 : 0;
+	uint8 p;
+
+	if(port > 3) {
+		return;
+	}
+	mask &= pin_mask[u][port];		/* leave UART and reserved pins alone */
+	if(!mask) {
+		return;
+	}
+
+	dseShadowLoad(port);
+	p = (ShadowP[port] & ~mask) | (value & mask);
+	if(p == ShadowP[port]) {
+		return;
+	}
+	ShadowP[port] = p;
+
+	if(PortBatch) {
+		PortDirty |= 1 << port;
 	} else {
-		p &= ~(1 << pin);
+		dseWriteRegister(pin_p[port], p);
 	}
-	dseWriteRegister(pin_p[port], p);
 }
 
 /*-------------------------------------------------------------------------------*/
-uint16 dsePinReadAnalog(uint8 port, uint8 pin) {
+void dsePortBegin() {
+/*-------------------------------------------------------------------------------*/
+	PortBatch = true;
+}
+
+/*-------------------------------------------------------------------------------*/
+void dsePortFlush() {
+/*-------------------------------------------------------------------------------*/
+	uint8 port;
+
+	PortBatch = false;
+	for(port = 0; port < 4; port++) {
+		if(PortDirty & (1 << port)) {
+			dseWriteRegister(pin_p[port], ShadowP[port]);
+		}
+	}
+	PortDirty = 0;
+}
+
+/*-------------------------------------------------------------------------------*/
+int dseAnalogSequenceIndex(uint8 port, uint8 pin) {
 /*-------------------------------------------------------------------------------*/
 	uint8 u = UartEnabled[1] ? 1 : 0;
 	uint8 mux = ANALOG_INDEX(port, pin);
+	uint8 index;
 
 	if(pin > 7 || port > 3 || !(pin_adc_mask[u][port] & (1 << pin)) || !AnalogPin[mux]) {
-		return 0;
+		return -1;
 	}
 
-	uint16 val;
-	uint8 index;
-
 	/* find sequence index */
 	for(index = 0; index < NumAnalogPins; index++) {
 		if(AnalogMuxSequence[index] == mux) {
-			break;
+			return index;
 		}
 	}
-	if(index == NumAnalogPins) {
-		return 0; /* given pin not in sequence... */
+	return -1; /* given pin not in sequence... */
+}
+
+/*-------------------------------------------------------------------------------*/
+static uint16 dseReadAnalogIndex(uint8 index) {
+/*-------------------------------------------------------------------------------*/
+	char buffer[5];
+	uint16 val;
+
+	buffer[0] = SELECT_READ | SELECT_ADC;
+	buffer[1] = index;
+	buffer[2] = buffer[3] = buffer[4] = 0;
+	if (dseQueuedTransfer(buffer, 5, 0, buffer) >= 0) {
+		return (((uint16) buffer[3]) << 8) | (buffer[4] & 0xFF);
 	}
 
+	cardSpiLock();
+
 	/* enable card SPI with CS hold */
 	cardSpiStart(true);
 
@@ -697,5 +1394,227 @@ uint16 dsePinReadAnalog(uint8 port, uint8 pin) {
 	swiDelay(12);
 #endif
 
+	cardSpiUnlock();
+
 	return val;
 }
+
+/*-------------------------------------------------------------------------------*/
+uint16 dsePinReadAnalog(uint8 port, uint8 pin) {
+/*-------------------------------------------------------------------------------*/
+	int index = dseAnalogSequenceIndex(port, pin);
+
+	if(index < 0) {
+		return 0;
+	}
+
+	return dseReadAnalogIndex(index);
+}
+
+/*-------------------------------------------------------------------------------*/
+uint8 dsePinReadAnalogAll(uint16 * values) {
+/*-------------------------------------------------------------------------------*/
+	uint8 index;
+
+	/* the firmware takes one sequence index per transaction, the sequence
+	   is walked in order without looking up the pins; the bus is locked
+	   per transaction, which keeps interrupts off only that long */
+	for(index = 0; index < NumAnalogPins; index++) {
+		values[AnalogMuxSequence[index]] = dseReadAnalogIndex(index);
+	}
+
+	return NumAnalogPins;
+}
+
+/* Asynchronous GPIO, handlers are called from the interrupt */
+
+static uint8 PinSet[4], PinClear[4];	/* changes waiting for their port write */
+static volatile bool PinBusy[4];		/* port read-modify-write in flight */
+
+/*-------------------------------------------------------------------------------*/
+static void dseAsyncPinRead(DseRequest *req) {
+/*-------------------------------------------------------------------------------*/
+	req->handler.pin((req->in[3] & (1 << req->pin)) != 0, req->user);
+}
+
+/*-------------------------------------------------------------------------------*/
+bool dsePinReadAsync(uint8 port, uint8 pin, void (*handler)(bool state, void *user), void *user) {
+/*-------------------------------------------------------------------------------*/
+	uint8 u = UartEnabled[1] ? 1 : 0;
+	DseRequest *req;
+
+	if(!AsyncMode || pin > 7 || port > 3 || !(pin_mask[u][port] & (1 << pin))) {
+		return false;
+	}
+
+	req = dsePrepareRegisterRead(pin_p[port]);
+	if(req == NULL) {
+		return false;
+	}
+	req->handler.pin = handler;
+	req->user = user;
+	req->pin = pin;
+	return dseSubmit(req, dseAsyncPinRead);
+}
+
+static bool dseAsyncPortUpdate(uint8 port);
+
+/*-------------------------------------------------------------------------------*/
+static void dseAsyncPortWritten(DseRequest *req) {
+/*-------------------------------------------------------------------------------*/
+	PinBusy[req->port] = false;
+
+	/* pins changed while the port was written */
+	if(PinSet[req->port] | PinClear[req->port]) {
+		dseAsyncPortUpdate(req->port);
+	}
+}
+
+/*-------------------------------------------------------------------------------*/
+static void dseAsyncPortRead(DseRequest *req) {
+/*-------------------------------------------------------------------------------*/
+	uint8 port = req->port;
+	char buffer[2];
+	DseRequest *write;
+
+	buffer[0] = pin_p[port];
+	buffer[1] = (req->in[3] | PinSet[port]) & ~PinClear[port];
+	if(ShadowValid & (1 << port)) {
+		ShadowP[port] = buffer[1];	/* keep the synchronous writes in step */
+	}
+
+	write = dsePrepareWrite(SELECT_REGISTER, 2, buffer);
+	if(write == NULL) {
+		PinBusy[port] = false;		/* changes stay pending for the next write */
+		return;
+	}
+	PinSet[port] = PinClear[port] = 0;
+	write->port = port;
+	if(!dseSubmit(write, dseAsyncPortWritten)) {
+		PinBusy[port] = false;
+	}
+}
+
+/*-------------------------------------------------------------------------------*/
+static bool dseAsyncPortUpdate(uint8 port) {
+/*-------------------------------------------------------------------------------*/
+	DseRequest *req = dsePrepareRegisterRead(pin_p[port]);
+
+	if(req == NULL) {
+		return false;
+	}
+	req->port = port;
+	PinBusy[port] = true;
+	if(!dseSubmit(req, dseAsyncPortRead)) {
+		PinBusy[port] = false;
+		return false;
+	}
+	return true;
+}
+
+/*-------------------------------------------------------------------------------*/
+bool dsePinWriteAsync(uint8 port, uint8 pin, bool state) {
+/*-------------------------------------------------------------------------------*/
+	uint8 u = UartEnabled[1] ? 1 : 0;
+	bool ok = true;
+	int oldIME;
+
+	if(!AsyncMode || pin > 7 || port > 3 || !(pin_mask[u][port] & (1 << pin))) {
+		return false;
+	}
+
+	/* writes to a port while its read-modify-write is in flight are folded
+	   into the next one */
+	oldIME = enterCriticalSection();
+	if(state) {
+		PinSet[port] |= 1 << pin;
+		PinClear[port] &= ~(1 << pin);
+	} else {
+		PinClear[port] |= 1 << pin;
+		PinSet[port] &= ~(1 << pin);
+	}
+	if(!PinBusy[port]) {
+		ok = dseAsyncPortUpdate(port);
+	}
+	leaveCriticalSection(oldIME);
+
+	return ok;
+}
+
+/*-------------------------------------------------------------------------------*/
+static void dseAsyncAnalogRead(DseRequest *req) {
+/*-------------------------------------------------------------------------------*/
+	req->handler.analog((((uint16) req->in[3]) << 8) | (req->in[4] & 0xFF), req->user);
+}
+
+/*-------------------------------------------------------------------------------*/
+bool dsePinReadAnalogAsync(uint8 port, uint8 pin, void (*handler)(uint16 val, void *user), void *user) {
+/*-------------------------------------------------------------------------------*/
+	int index = dseAnalogSequenceIndex(port, pin);
+	DseRequest *req;
+
+	if(!AsyncMode || index < 0) {
+		return false;
+	}
+
+	req = dseRequestAlloc();
+	if(req == NULL) {
+		return false;
+	}
+	req->out[0] = SELECT_READ | SELECT_ADC;
+	req->out[1] = index;
+	req->out[2] = req->out[3] = req->out[4] = 0;
+	req->xfer.count = 5;
+	req->xfer.sized = 0;
+	req->handler.analog = handler;
+	req->user = user;
+	return dseSubmit(req, dseAsyncAnalogRead);
+}
+
+static void dseAsyncAnalogAllRead(DseRequest *req);
+
+/*-------------------------------------------------------------------------------*/
+static bool dseAsyncAnalogNext(uint8 index, uint16 *values, void (*handler)(uint8 count, void *user), void *user) {
+/*-------------------------------------------------------------------------------*/
+	DseRequest *req = dseRequestAlloc();
+
+	if(req == NULL) {
+		return false;
+	}
+	req->out[0] = SELECT_READ | SELECT_ADC;
+	req->out[1] = index;
+	req->out[2] = req->out[3] = req->out[4] = 0;
+	req->xfer.count = 5;
+	req->xfer.sized = 0;
+	req->pin = index;
+	req->values = values;
+	req->handler.analogAll = handler;
+	req->user = user;
+	return dseSubmit(req, dseAsyncAnalogAllRead);
+}
+
+/*-------------------------------------------------------------------------------*/
+static void dseAsyncAnalogAllRead(DseRequest *req) {
+/*-------------------------------------------------------------------------------*/
+	uint8 index = req->pin;
+
+	req->values[AnalogMuxSequence[index]] = (((uint16) req->in[3]) << 8) | (req->in[4] & 0xFF);
+
+	/* one read in flight at a time, each one queues the next */
+	if(index + 1 < NumAnalogPins
+		&& dseAsyncAnalogNext(index + 1, req->values, req->handler.analogAll, req->user)) {
+		return;
+	}
+	if(req->handler.analogAll != NULL) {
+		req->handler.analogAll(index + 1, req->user);
+	}
+}
+
+/*-------------------------------------------------------------------------------*/
+bool dsePinReadAnalogAllAsync(uint16 * values, void (*handler)(uint8 count, void *user), void *user) {
+/*-------------------------------------------------------------------------------*/
+	if(!AsyncMode || NumAnalogPins == 0) {
+		return false;
+	}
+	return dseAsyncAnalogNext(0, values, handler, user);
+}
@@ -0,0 +1,169 @@
+//    Free running time base for DSMI, built on one hardware timer.
+
+#include <nds.h>
+
+#include "dsmi_clock.h"
+
+#define CLOCK_TIMER_OFF 0xFF
+
+static u8 clock_timer = CLOCK_TIMER_OFF;
+static volatile u32 clock_high = 0; // upper 16 bits, counted by the overflow irq
+
+// The alarm counts down the remaining ticks on its own timer in steps of
+// at most 0xFFFF, so a late alarm never delays the clock itself. Between
+// alarms its timer keeps running with the irq masked, so it stays taken
+// for everyone probing for a free one.
+static u8 alarm_timer = CLOCK_TIMER_OFF;
+static void (*alarm_handler)(void) = NULL;
+static volatile bool alarm_armed = false;
+static volatile u32 alarm_at = 0;
+
+static void dsmi_clock_irq(void)
+{
+	clock_high += 0x10000;
+}
+
+// Returns the highest free timer below TIMER3, or CLOCK_TIMER_OFF
+static u8 dsmi_clock_probe_timer(void)
+{
+	int i;
+
+	for(i = 2; 0 <= i; i--) {
+		if((TIMER_CR(i) & TIMER_ENABLE) || i == clock_timer)
+			continue;
+		return i;
+	}
+
+	return CLOCK_TIMER_OFF;
+}
+
+static void dsmi_clock_start_alarm(s32 left)
+{
+	if(left < 1)
+		left = 1;
+	else if(left > 0xFFFF)
+		left = 0xFFFF;
+
+	// restarting loads the new count, interrupts are off here
+	TIMER_CR(alarm_timer) = 0;
+	TIMER_DATA(alarm_timer) = 0x10000 - left;
+	TIMER_CR(alarm_timer) = TIMER_DIV_64 | TIMER_IRQ_REQ | TIMER_ENABLE;
+
+	// forget the overflows while it was masked
+	REG_IF = IRQ_TIMER(alarm_timer);
+	irqEnable(IRQ_TIMER(alarm_timer));
+}
+
+static void dsmi_clock_alarm_irq(void)
+{
+	s32 left;
+
+	irqDisable(IRQ_TIMER(alarm_timer));
+
+	if(!alarm_armed)
+		return;
+
+	left = alarm_at - dsmi_clock_ticks();
+	if(left > 0) {
+		// more than one timer period away
+		dsmi_clock_start_alarm(left);
+		return;
+	}
+
+	alarm_armed = false;
+	if(alarm_handler != NULL)
+		alarm_handler();
+}
+
+bool dsmi_clock_init(void)
+{
+	if(clock_timer != CLOCK_TIMER_OFF)
+		return true;
+
+	clock_timer = dsmi_clock_probe_timer();
+	if(clock_timer == CLOCK_TIMER_OFF)
+		return false;
+
+	clock_high = 0;
+	irqSet(IRQ_TIMER(clock_timer), dsmi_clock_irq);
+	irqEnable(IRQ_TIMER(clock_timer));
+
+	TIMER_DATA(clock_timer) = 0;
+	TIMER_CR(clock_timer) = TIMER_DIV_64 | TIMER_IRQ_REQ | TIMER_ENABLE;
+
+	return true;
+}
+
+bool dsmi_clock_running(void)
+{
+	return clock_timer != CLOCK_TIMER_OFF;
+}
+
+u32 dsmi_clock_ticks(void)
+{
+	u32 high;
+	u16 low;
+	int oldIME;
+
+	if(clock_timer == CLOCK_TIMER_OFF)
+		return 0;
+
+	oldIME = enterCriticalSection();
+
+	high = clock_high;
+	low = TIMER_DATA(clock_timer);
+
+	// the counter wrapped, but the irq has not been serviced yet
+	if((REG_IF & IRQ_TIMER(clock_timer)) && low < 0x8000)
+		high += 0x10000;
+
+	leaveCriticalSection(oldIME);
+
+	return high | low;
+}
+
+bool dsmi_clock_alarm_init(void (*handler)(void))
+{
+	if(!dsmi_clock_init())
+		return false;
+
+	if(alarm_timer == CLOCK_TIMER_OFF) {
+		alarm_timer = dsmi_clock_probe_timer();
+		if(alarm_timer == CLOCK_TIMER_OFF)
+			return false;
+
+		irqSet(IRQ_TIMER(alarm_timer), dsmi_clock_alarm_irq);
+		irqDisable(IRQ_TIMER(alarm_timer));
+		TIMER_DATA(alarm_timer) = 0;
+		TIMER_CR(alarm_timer) = TIMER_DIV_64 | TIMER_IRQ_REQ | TIMER_ENABLE;
+	}
+
+	alarm_handler = handler;
+
+	return true;
+}
+
+void dsmi_clock_set_alarm(u32 when)
+{
+	int oldIME;
+
+	if(alarm_timer == CLOCK_TIMER_OFF)
+		return;
+
+	oldIME = enterCriticalSection();
+
+	alarm_at = when;
+	alarm_armed = true;
+	dsmi_clock_start_alarm(when - dsmi_clock_ticks());
+
+	leaveCriticalSection(oldIME);
+}
+
+void dsmi_clock_cancel_alarm(void)
+{
+	if(alarm_timer == CLOCK_TIMER_OFF)
+		return;
+
+	alarm_armed = false;
+	irqDisable(IRQ_TIMER(alarm_timer));
+}
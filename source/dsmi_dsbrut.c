@@ -0,0 +1,422 @@
+//    DSBrut transport. MIDI goes through the uart of the DSBrut, which
+//    is exchanged over the card spi from a timer interrupt in uart.c.
+//    With dsmi_connect_dsbrut_arm7 the uart runs on the ARM7 instead
+//    (see dsmi_arm7.h) and this side only fills and empties its rings.
+
+#include <nds.h>
+#include <string.h>
+
+#include "libdsmi.h"
+#include "uart.h"
+#include "midi_parser.h"
+#include "dsmi_stats.h"
+#include "dsmi_internals.h"
+#include "dsmi_arm7.h"
+
+#define DSBRUT_TX_SIZE		64	// bytes collected per uart_write while batching
+
+int dsbrut_enabled = 0;
+
+// Decodes the DSBrut input straight from the uart input queue
+static midi_parser dsbrut_parser;
+
+// While routing from the DSBrut the input is decoded in the spi irq and
+// what is delivered waits here for dsmi_read_dsbrut
+static midi_queue dsbrut_queue;
+
+// Messages collected between dsmi_write_begin and dsmi_write_commit
+static u8 dsbrut_tx[DSBRUT_TX_SIZE];
+static int dsbrut_tx_size = 0;
+
+// Shared with the ARM7 component, padded to whole cache lines so nothing
+// else shares them. arm7 points to its uncached mirror once connected.
+static union {
+	dsmi_arm7_shared shared;
+	u8 pad[(sizeof(dsmi_arm7_shared) + 31) & ~31];
+} arm7_block __attribute__((aligned(32)));
+static dsmi_arm7_shared* arm7 = NULL;
+static u32 arm7_drops = 0;	// arm7->drops_in already counted
+
+// ------------ PRIVATE ------------ //
+
+// Queues bytes for the ARM7, all of them or, unless whole is set, as many
+// as fit. Returns the number queued. The caller keeps interrupts off.
+static int dsmi_arm7_put(const u8* data, int size, int whole)
+{
+	u16 tail = arm7->out_tail;
+	int space = DSMI_ARM7_OUT_SIZE - (u16)(tail - arm7->out_head);
+	int i;
+
+	if(size > space) {
+		DSMI_COUNT(iface[DSMI_BRUT].short_writes, 1);
+		if(whole)
+			return 0;
+		size = space;
+	}
+
+	for(i = 0; i < size; i++)
+		arm7->out[tail++ & (DSMI_ARM7_OUT_SIZE - 1)] = data[i];
+	arm7->out_tail = tail;
+
+	// the ARM7 clears kick before it looks at the ring
+	if(size > 0 && !arm7->kick) {
+		arm7->kick = 1;
+		fifoSendValue32(DSMI_ARM7_FIFO, DSMI_ARM7_KICK);
+	}
+
+	return size;
+}
+
+// Sends whole serial MIDI messages. Safe to call from interrupts, the
+// messages are never interleaved with others. They are dropped (and
+// counted) all at once if they don't fit, before the running status
+// takes them as sent.
+static void dsmi_dsbrut_send(const u8* data, int size)
+{
+	u8 buf[DSBRUT_TX_SIZE];
+	int oldIME = enterCriticalSection();
+	int space, need, i;
+
+	if(arm7 != NULL) {
+		space = DSMI_ARM7_OUT_SIZE - (u16)(arm7->out_tail - arm7->out_head);
+		need = size;
+	} else {
+		// the uart escapes these with a backslash
+		space = uart_writable();
+		for(need = size, i = 0; i < size; i++) {
+			if(data[i] == 0x00 || data[i] == '\\')
+				need++;
+		}
+	}
+
+	if(need > space) {
+		DSMI_COUNT(iface[DSMI_BRUT].drops_out, 1);
+		leaveCriticalSection(oldIME);
+		return;
+	}
+
+	size = dsmi_running_status(DSMI_BRUT, buf, data, size);
+	if(arm7 != NULL)
+		dsmi_arm7_put(buf, size, 1);
+	else
+		uart_write(buf, size);
+
+	leaveCriticalSection(oldIME);
+}
+
+void dsmi_flush_dsbrut(void)
+{
+	if(dsbrut_tx_size > 0) {
+		dsmi_dsbrut_send(dsbrut_tx, dsbrut_tx_size);
+		dsbrut_tx_size = 0;
+	}
+}
+
+void dsmi_write_now_dsbrut(u8 message, u8 data1, u8 data2)
+{
+	u8 sendbuf[3];
+
+	DSMI_COUNT(iface[DSMI_BRUT].msgs_out, 1);
+	dsmi_dsbrut_send(sendbuf, dsmi_pack_serial(sendbuf, message, data1, data2));
+}
+
+// Sends n messages in as few uart writes as possible, bypassing batching
+static void dsmi_write_now_batch_dsbrut(const dsmi_msg* msgs, int n)
+{
+	u8 buf[DSBRUT_TX_SIZE];
+	int size = 0;
+	int i;
+
+	DSMI_COUNT(iface[DSMI_BRUT].msgs_out, n);
+	for(i = 0; i < n; i++) {
+		if(size + 3 > DSBRUT_TX_SIZE) {
+			dsmi_dsbrut_send(buf, size);
+			size = 0;
+		}
+		size += dsmi_pack_serial(buf + size, msgs[i].message, msgs[i].data1, msgs[i].data2);
+	}
+	if(size > 0)
+		dsmi_dsbrut_send(buf, size);
+}
+
+// Takes up to max messages, decoding them straight from the uart input
+// queue, or from the ARM7's queue
+static int dsmi_dsbrut_take(dsmi_msg* msgs, int max)
+{
+	uint8* buf;
+	uint16 size, i;
+	int count = 0;
+
+	if(arm7 != NULL) {
+		while(count < max && midi_queue_pop(&arm7->in, &msgs[count]))
+			count++;
+
+		DSMI_COUNT(iface[DSMI_BRUT].drops_in, arm7->drops_in - arm7_drops);
+		arm7_drops = arm7->drops_in;
+		return count;
+	}
+
+	while(count < max && (size = uart_peek(&buf)) > 0) {
+		for(i = 0; i < size && count < max; i++) {
+			if(midi_parse(&dsbrut_parser, buf[i], &msgs[count]))
+				count++;
+		}
+		uart_skip(i);
+	}
+
+	return count;
+}
+
+// Called from the DSBrut spi irq when bytes came in. In DSMI_CALLBACK_IRQ
+// mode or while routing from the DSBrut the input is read from here,
+// otherwise it waits for dsmi_read_dsbrut.
+static void dsmi_dsbrut_recv(void)
+{
+	dsmi_msg msgs[8];
+	int irq = dsmi_read_callback != NULL && dsmi_read_callback_mode == DSMI_CALLBACK_IRQ;
+	int routed = dsmi_routed_from & (1 << DSMI_BRUT);
+	int n, i;
+
+	if(!irq && !routed)
+		return;
+
+	while((n = dsmi_dsbrut_take(msgs, 8)) > 0) {
+		for(i = 0; i < n; i++) {
+			if(routed && !dsmi_route_msg(DSMI_BRUT, &msgs[i]))
+				continue;
+			if(irq) {
+				DSMI_COUNT(iface[DSMI_BRUT].msgs_in, 1);
+				dsmi_read_callback(msgs[i].message, msgs[i].data1, msgs[i].data2);
+			} else if(midi_queue_push(&dsbrut_queue, &msgs[i]))
+				DSMI_COUNT(iface[DSMI_BRUT].msgs_in, 1);
+			else
+				DSMI_COUNT(iface[DSMI_BRUT].drops_in, 1);
+		}
+	}
+
+	if(routed)
+		dsmi_route_commit(DSMI_BRUT);
+}
+
+// DSMI_ARM7_RECEIVED takes the place of the uart receive handler
+static void dsmi_dsbrut_arm7_value(u32 value, void* data)
+{
+	if(value == DSMI_ARM7_RECEIVED)
+		dsmi_dsbrut_recv();
+}
+
+// ------------ SETUP ------------ //
+
+extern int dsmi_connect_dsbrut(void)
+{
+	if(!uart_init())
+		return 0;
+	
+	dsmi_dsbrut_open();
+	
+	return 1;
+}
+
+// Sets up MIDI on the uart once uart_init or uart_init_poll found it
+void dsmi_dsbrut_open(void)
+{
+	uart_set_bps(31250); // MIDI baud rate
+	
+	midi_parser_init(&dsbrut_parser);
+	midi_queue_init(&dsbrut_queue);
+	uart_set_receive_handler(dsmi_dsbrut_recv);
+	
+	dsmi_select_interface(DSMI_BRUT);
+
+	dsbrut_enabled = 1;
+}
+
+// Hands the card bus to the ARM7, which has to run dsmi_arm7_init and
+// dsmi_arm7_poll (libdsmi7.a), and waits up to two seconds for its uart
+extern int dsmi_connect_dsbrut_arm7(void)
+{
+	u32 answer = 0;
+	int i;
+
+	if(arm7 != NULL)
+		return 1;
+
+	// no cached copy of the block may be written back over the ARM7's data
+	DC_InvalidateRange(&arm7_block, sizeof(arm7_block));
+	arm7 = (dsmi_arm7_shared*)memUncached(&arm7_block.shared);
+	memset(arm7, 0, sizeof(dsmi_arm7_shared));
+	midi_queue_init(&arm7->in);
+	midi_queue_init(&dsbrut_queue);
+	arm7->notify = 1;
+	arm7_drops = 0;
+
+	sysSetCardOwner(BUS_OWNER_ARM7);
+	fifoSendAddress(DSMI_ARM7_FIFO, arm7);
+
+	for(i = 0; i < 120 && !fifoCheckValue32(DSMI_ARM7_FIFO); i++)
+		swiWaitForVBlank();
+	if(fifoCheckValue32(DSMI_ARM7_FIFO))
+		answer = fifoGetValue32(DSMI_ARM7_FIFO);
+
+	if(answer != DSMI_ARM7_READY) {
+		arm7 = NULL;
+		sysSetCardOwner(BUS_OWNER_ARM9);
+		return 0;
+	}
+
+	fifoSetValue32Handler(DSMI_ARM7_FIFO, dsmi_dsbrut_arm7_value, 0);
+
+	dsmi_select_interface(DSMI_BRUT);
+
+	dsbrut_enabled = 1;
+
+	return 1;
+}
+
+// ------------ WRITE ------------ //
+
+// Force a MIDI message to be sent over DSBrut
+extern void dsmi_write_dsbrut(u8 message,u8 data1, u8 data2)
+{
+	uint8_t sendbuf[3];
+	int size;
+	DSMI_HIST_DECL(start);
+
+	DSMI_HIST_BEGIN(start);
+
+	if(!dsmi_batching) {
+		dsmi_write_now_dsbrut(message, data1, data2);
+	} else {
+		DSMI_COUNT(iface[DSMI_BRUT].msgs_out, 1);
+		size = dsmi_pack_serial(sendbuf, message, data1, data2);
+
+		if(dsbrut_tx_size + size > DSBRUT_TX_SIZE)
+			dsmi_flush_dsbrut();
+		memcpy(dsbrut_tx + dsbrut_tx_size, sendbuf, size);
+		dsbrut_tx_size += size;
+	}
+
+	DSMI_HIST_END(DSMI_HIST_WRITE_DSBRUT, start);
+}
+
+// Writes n messages as one batch, inside dsmi_write_begin/commit they
+// go out with the rest
+void dsmi_write_batch_dsbrut(const dsmi_msg* msgs, int n)
+{
+	int nested = dsmi_batching;
+	int i;
+
+	dsmi_batching = 1;
+	for(i = 0; i < n; i++)
+		dsmi_write_dsbrut(msgs[i].message, msgs[i].data1, msgs[i].data2);
+	dsmi_batching = nested;
+
+	if(!nested)
+		dsmi_flush_dsbrut();
+}
+
+// Realtime messages take the realtime lane of the uart, so they don't
+// wait for queued output
+extern void dsmi_sync_write_dsbrut(u8 message)
+{
+	int oldIME;
+
+	DSMI_COUNT(iface[DSMI_BRUT].msgs_out, 1);
+
+	if(message < 0xF8) {
+		dsmi_dsbrut_send(&message, 1);
+	} else if(arm7 != NULL) {
+		oldIME = enterCriticalSection();
+		if((u16)(arm7->rt_tail - arm7->rt_head) < DSMI_ARM7_RT_SIZE) {
+			arm7->rt[arm7->rt_tail & (DSMI_ARM7_RT_SIZE - 1)] = message;
+			arm7->rt_tail++;
+		}
+		if(!arm7->kick) {
+			arm7->kick = 1;
+			fifoSendValue32(DSMI_ARM7_FIFO, DSMI_ARM7_KICK);
+		}
+		leaveCriticalSection(oldIME);
+	} else {
+		oldIME = enterCriticalSection();
+		uart_write_rt(&message, 1);
+		leaveCriticalSection(oldIME);
+	}
+}
+
+// ------------ SYSEX ------------ //
+
+// Queues as much of a SysEx as the uart takes and returns the number of
+// bytes taken, the realtime lane still goes ahead of it
+extern int dsmi_sysex_write_dsbrut(const u8* data, int size)
+{
+	int oldIME;
+	int n;
+
+	if(size <= 0)
+		return 0;
+
+	// the receiver forgets the running status on the F0, and the batched
+	// messages have to go out before the SysEx
+	dsmi_running_status_reset(DSMI_BRUT);
+	dsmi_flush_dsbrut();
+
+	oldIME = enterCriticalSection();
+	if(arm7 != NULL)
+		n = dsmi_arm7_put(data, size, 0);
+	else
+		n = uart_write((uint8*)data, size);
+	leaveCriticalSection(oldIME);
+
+	return n;
+}
+
+// ------------ READ ------------ //
+
+// Force receiving over DSBrut
+extern int dsmi_read_dsbrut(u8* message, u8* data1, u8* data2)
+{
+	dsmi_msg msg;
+
+	if(!dsmi_read_dsbrut_batch(&msg, 1))
+		return 0;
+
+	*message = msg.message;
+	*data1 = msg.data1;
+	*data2 = msg.data2;
+
+	return 1;
+}
+
+// Receives up to max messages over DSBrut, the parser works directly on
+// the uart ring buffer and only consumes the bytes it has used
+extern int dsmi_read_dsbrut_batch(dsmi_msg* msgs, int max)
+{
+	int count = 0;
+
+	// decoded and counted in the spi irq already
+	if(dsmi_routed_from & (1 << DSMI_BRUT)) {
+		while(count < max && midi_queue_pop(&dsbrut_queue, &msgs[count]))
+			count++;
+		return count;
+	}
+
+	count = dsmi_dsbrut_take(msgs, max);
+
+	DSMI_COUNT(iface[DSMI_BRUT].msgs_in, count);
+	return count;
+}
+
+const dsmi_transport dsmi_dsbrut_transport = {
+	DSMI_BRUT,
+	&dsbrut_enabled,
+	&dsbrut_parser,
+	dsmi_write_dsbrut,
+	dsmi_write_now_dsbrut,
+	dsmi_write_batch_dsbrut,
+	dsmi_write_now_batch_dsbrut,
+	dsmi_sync_write_dsbrut,
+	dsmi_read_dsbrut,
+	dsmi_sysex_write_dsbrut,
+	dsmi_flush_dsbrut,
+	NULL
+};
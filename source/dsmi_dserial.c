@@ -0,0 +1,712 @@
+//    DSerial transport. MIDI goes through UART0 of the DSerial, output is
+//    queued and handed to the card in chunks from its TX interrupt, input
+//    is parsed in the receive interrupt. Carts with UART1 get a second
+//    port with its own queues, so both transmit at the same time.
+
+#include <nds.h>
+#include <string.h>
+
+#include "libdsmi.h"
+#include "dserial.h"
+#include "card_spi.h"
+#include "firmware_bin.h"
+#include "midi_parser.h"
+#include "dsmi_stats.h"
+#include "dsmi_internals.h"
+
+#define DSERIAL_FIFO_SIZE	256	// bytes in the DSerial transmit queue, power of two
+#define DSERIAL_RT_SIZE		16	// bytes in the DSerial realtime lane, power of two
+#define DSERIAL_RT_CHUNK	8	// max chunk size while realtime bytes are flowing
+#define DSERIAL_RT_HOLD		16	// number of chunks to keep them that small
+#define ANALOG_PINS		16	// DSerial analog pins, indexed by (port - 1) * 8 + pin
+#define ANALOG_BITS		10	// resolution of the DSerial ADC
+
+int dserial_enabled = 0;
+
+// One MIDI port, port 0 is UART0 and port 1 UART1
+typedef struct {
+	// Filled from the receive interrupt, emptied by dsmi_read_dserial_port
+	midi_parser parser;
+	midi_queue queue;
+
+	// Transmit queue, drained in chunks of up to MAX_DATA_SIZE bytes
+	// from the TX interrupt of the UART
+	u8 fifo[DSERIAL_FIFO_SIZE];
+	volatile u16 fifo_head;
+	volatile u16 fifo_tail;
+	volatile int sending;
+	volatile int stalled;	// the last chunk wasn't taken, it is sent again
+	u32 fifo_drops;
+
+	// Realtime lane, its bytes go out at the start of the next chunk
+	u8 rt[DSERIAL_RT_SIZE];
+	volatile u16 rt_head;
+	volatile u16 rt_tail;
+	int rt_recent;
+
+	// Messages collected between dsmi_write_begin and dsmi_write_commit
+	u8 tx[MAX_DATA_SIZE];
+	int tx_size;
+} dserial_port;
+
+static dserial_port dserial_ports[DSMI_DSERIAL_PORTS];
+static int dserial_num_ports = 0;	// ports set up by dsmi_dserial_start
+static int dserial_async = 0;		// dseAsyncInit succeeded
+
+// Running status is kept per UART
+static const int dserial_running[DSMI_DSERIAL_PORTS] = { DSMI_SERIAL, DSMI_SERIAL_UART1 };
+
+// DSerial analog pins sent as MIDI CCs by dsmi_analog_update
+typedef struct {
+	u8 mapped;
+	u8 channel;
+	u8 cc;
+	u8 value;		// CC value last sent, 0xFF if none yet
+	u16 raw;		// ADC value it was sent for
+	u16 deadband;	// raw change needed before a new CC is sent
+} analog_map;
+
+static analog_map analog[ANALOG_PINS];
+static u16 analog_values[ANALOG_PINS];
+static int analog_mapped = 0;
+
+// In async mode the pins are read in the background into analog_reading,
+// a pass is ANALOG_BUSY until its handler has run
+#define ANALOG_IDLE	0
+#define ANALOG_BUSY	1
+#define ANALOG_DONE	2
+
+static u16 analog_reading[ANALOG_PINS];
+static volatile int analog_pass = ANALOG_IDLE;
+
+// ------------ PRIVATE ------------ //
+
+// Called from dseIrqHandler with the bytes received on UART0. UART0 is
+// the one that is routed and handed to the read callback.
+static void dsmi_uart_recv(char * data, unsigned int size)
+{
+	dsmi_msg msg;
+	unsigned int i;
+
+	DSMI_COUNT(iface[DSMI_SERIAL].bytes_in, size);
+	for(i = 0; i < size; i++) {
+		if(midi_parse(&dserial_ports[0].parser, data[i], &msg)) {
+			if((dsmi_routed_from & (1 << DSMI_SERIAL)) && !dsmi_route_msg(DSMI_SERIAL, &msg))
+				continue;
+			if(dsmi_read_callback != NULL && dsmi_read_callback_mode == DSMI_CALLBACK_IRQ) {
+				DSMI_COUNT(iface[DSMI_SERIAL].msgs_in, 1);
+				dsmi_read_callback(msg.message, msg.data1, msg.data2);
+			} else if(midi_queue_push(&dserial_ports[0].queue, &msg))
+				DSMI_COUNT(iface[DSMI_SERIAL].msgs_in, 1);
+			else
+				DSMI_COUNT(iface[DSMI_SERIAL].drops_in, 1);
+		}
+	}
+
+	if(dsmi_routed_from & (1 << DSMI_SERIAL))
+		dsmi_route_commit(DSMI_SERIAL);
+}
+
+// The same for UART1, its messages are only queued
+static void dsmi_uart1_recv(char * data, unsigned int size)
+{
+	dsmi_msg msg;
+	unsigned int i;
+
+	DSMI_COUNT(iface[DSMI_SERIAL].bytes_in, size);
+	for(i = 0; i < size; i++) {
+		if(!midi_parse(&dserial_ports[1].parser, data[i], &msg))
+			continue;
+		if(midi_queue_push(&dserial_ports[1].queue, &msg))
+			DSMI_COUNT(iface[DSMI_SERIAL].msgs_in, 1);
+		else
+			DSMI_COUNT(iface[DSMI_SERIAL].drops_in, 1);
+	}
+}
+
+// Hands the next chunk of the transmit queue of a port to the DSerial.
+// Runs in the TX interrupt of its UART or with interrupts disabled. The
+// queues only give up the chunk once the DSerial took it.
+static void dsmi_dserial_send_next(int port)
+{
+	dserial_port* p = &dserial_ports[port];
+	char chunk[MAX_DATA_SIZE];
+	u16 head = p->fifo_head;
+	u16 rt_head = p->rt_head;
+	int size = (u16)(p->fifo_tail - head);
+	int limit = MAX_DATA_SIZE;
+	int recent = p->rt_recent;
+	int n = 0;
+	int i;
+
+	// realtime bytes first
+	while(rt_head != p->rt_tail && n < MAX_DATA_SIZE)
+		chunk[n++] = p->rt[rt_head++ & (DSERIAL_RT_SIZE - 1)];
+
+	if(n > 0)
+		recent = DSERIAL_RT_HOLD;
+
+	// a chunk can't be interrupted once it is sent, so keep them short
+	// while realtime bytes are flowing
+	if(recent > 0) {
+		limit = DSERIAL_RT_CHUNK;
+		recent--;
+	}
+
+	if(size > limit - n)
+		size = limit - n;
+	if(size < 0)
+		size = 0;
+	for(i = 0; i < size; i++)
+		chunk[n++] = p->fifo[(head + i) & (DSERIAL_FIFO_SIZE - 1)];
+
+	if(n == 0) {
+		p->sending = 0;
+		p->stalled = 0;
+		return;
+	}
+
+	p->sending = 1;
+	if(!dseUartSendBuffer(port == 0 ? UART0 : UART1, chunk, n, false)) {
+		// no queued transfer left, the chunk stays queued and is sent
+		// again with the next enqueue, card interrupt or dsmi_flush
+		p->stalled = 1;
+		return;
+	}
+
+	p->stalled = 0;
+	p->fifo_head = head + size;
+	p->rt_head = rt_head;
+	p->rt_recent = recent;
+	DSMI_COUNT(iface[DSMI_SERIAL].bytes_out, n);
+}
+
+// Sends the chunks again that the DSerial had no room for. Runs in an
+// interrupt or with interrupts disabled.
+static void dsmi_dserial_retry(void)
+{
+	int port;
+
+	for(port = 0; port < dserial_num_ports; port++) {
+		if(dserial_ports[port].stalled)
+			dsmi_dserial_send_next(port);
+	}
+}
+
+// Counts and times the DSerial card interrupt. The requests it finishes
+// make room for a stalled chunk.
+static void dsmi_dserial_irq(void)
+{
+	DSMI_HIST_DECL(start);
+
+	DSMI_HIST_BEGIN(start);
+	DSMI_COUNT(dserial_irqs, 1);
+	dseIrqHandler();
+	dsmi_dserial_retry();
+	DSMI_HIST_END(DSMI_HIST_DSERIAL_IRQ, start);
+}
+
+// Called from dseIrqHandler when the previous chunk has been sent
+static void dsmi_uart_sent(void)
+{
+	dsmi_dserial_send_next(0);
+}
+
+static void dsmi_uart1_sent(void)
+{
+	dsmi_dserial_send_next(1);
+}
+
+// Queues bytes for sending over a DSerial port and returns immediately.
+// The bytes are dropped (and counted) if they don't fit.
+static int dsmi_dserial_enqueue(int port, const u8* data, int size)
+{
+	dserial_port* p = &dserial_ports[port];
+	int oldIME = enterCriticalSection();
+	u16 tail = p->fifo_tail;
+	int i;
+
+	if(DSERIAL_FIFO_SIZE - (u16)(tail - p->fifo_head) < size) {
+		p->fifo_drops++;
+		DSMI_COUNT(iface[DSMI_SERIAL].drops_out, 1);
+		leaveCriticalSection(oldIME);
+		return 0;
+	}
+
+	for(i = 0; i < size; i++)
+		p->fifo[(tail + i) & (DSERIAL_FIFO_SIZE - 1)] = data[i];
+	p->fifo_tail = tail + size;
+
+	if(!p->sending || p->stalled)
+		dsmi_dserial_send_next(port);
+
+	leaveCriticalSection(oldIME);
+
+	return 1;
+}
+
+// Queues a realtime byte, which cuts ahead of the bytes in the queue
+static void dsmi_dserial_enqueue_rt(int port, u8 message)
+{
+	dserial_port* p = &dserial_ports[port];
+	int oldIME = enterCriticalSection();
+
+	if((u16)(p->rt_tail - p->rt_head) == DSERIAL_RT_SIZE) {
+		p->fifo_drops++;
+		DSMI_COUNT(iface[DSMI_SERIAL].drops_out, 1);
+	} else {
+		p->rt[p->rt_tail & (DSERIAL_RT_SIZE - 1)] = message;
+		p->rt_tail++;
+
+		if(!p->sending || p->stalled)
+			dsmi_dserial_send_next(port);
+	}
+
+	leaveCriticalSection(oldIME);
+}
+
+// Sends whole serial MIDI messages. Safe to call from interrupts, the
+// messages are never interleaved with others. They are dropped (and
+// counted) all at once if they don't fit, before the running status
+// takes them as sent.
+static void dsmi_dserial_send(int port, const u8* data, int size)
+{
+	dserial_port* p = &dserial_ports[port];
+	u8 buf[MAX_DATA_SIZE];
+	int oldIME = enterCriticalSection();
+
+	if(DSERIAL_FIFO_SIZE - (u16)(p->fifo_tail - p->fifo_head) < size) {
+		p->fifo_drops++;
+		DSMI_COUNT(iface[DSMI_SERIAL].drops_out, 1);
+		leaveCriticalSection(oldIME);
+		return;
+	}
+
+	size = dsmi_running_status(dserial_running[port], buf, data, size);
+	dsmi_dserial_enqueue(port, buf, size);
+
+	leaveCriticalSection(oldIME);
+}
+
+// Returns the port, NULL if it isn't set up
+static dserial_port* dsmi_dserial_port(int port)
+{
+	if(port < 0 || port >= dserial_num_ports)
+		return NULL;
+	return &dserial_ports[port];
+}
+
+void dsmi_flush_dserial(void)
+{
+	dserial_port* p;
+	int port;
+
+	for(port = 0; port < dserial_num_ports; port++) {
+		p = &dserial_ports[port];
+		if(p->tx_size > 0) {
+			dsmi_dserial_send(port, p->tx, p->tx_size);
+			p->tx_size = 0;
+		}
+	}
+}
+
+// Sends the chunks again that the DSerial had no room for
+static void dsmi_dserial_frame(void)
+{
+	int oldIME = enterCriticalSection();
+
+	dsmi_dserial_retry();
+
+	leaveCriticalSection(oldIME);
+}
+
+void dsmi_write_now_dserial(u8 message, u8 data1, u8 data2)
+{
+	u8 sendbuf[3];
+
+	DSMI_COUNT(iface[DSMI_SERIAL].msgs_out, 1);
+	dsmi_dserial_send(0, sendbuf, dsmi_pack_serial(sendbuf, message, data1, data2));
+}
+
+// Sends n messages in as few chunks as possible, bypassing batching
+static void dsmi_write_now_batch_dserial(const dsmi_msg* msgs, int n)
+{
+	u8 buf[MAX_DATA_SIZE];
+	int size = 0;
+	int i;
+
+	DSMI_COUNT(iface[DSMI_SERIAL].msgs_out, n);
+	for(i = 0; i < n; i++) {
+		if(size + 3 > MAX_DATA_SIZE) {
+			dsmi_dserial_send(0, buf, size);
+			size = 0;
+		}
+		size += dsmi_pack_serial(buf + size, msgs[i].message, msgs[i].data1, msgs[i].data2);
+	}
+	if(size > 0)
+		dsmi_dserial_send(0, buf, size);
+}
+
+// ------------ SETUP ------------ //
+
+extern void dsmi_set_upload_progress_handler(void (*handler)(unsigned int done, unsigned int total))
+{
+	dseSetProgressHandler(handler);
+}
+
+// Sets up the DSerial, uploading the firmware if necessary
+extern int dsmi_connect_dserial(void)
+{
+	if(!dseInit())
+		return 0;
+	
+	//int version = dseVersion();
+	//if(version < 2) {
+	//	printf("Version: DSerial1/2\n");
+	//} else if(version == 2) {
+	//	printf("Version: DSerial Edge\n");
+	//}
+	
+	// Upload firmware if necessary
+	if (!dseMatchFirmware((char*)firmware_bin, firmware_bin_end - firmware_bin))
+	{
+		dseUploadFirmwareDelta((char *) firmware_bin, firmware_bin_end - firmware_bin);
+	}
+	
+	return dsmi_dserial_start();
+}
+
+// Boots the DSerial firmware and sets up the MIDI UARTs
+int dsmi_dserial_start(void)
+{
+	dseBoot();
+	
+	swiDelay(9999); // Wait for the FW to boot
+	if (dseStatus() != FIRMWARE)
+		return 0;
+	
+	return dsmi_dserial_open();
+}
+
+// Sets up the MIDI UARTs once the firmware is running
+int dsmi_dserial_open(void)
+{
+	dserial_port* p;
+	int port;
+
+	dseSetModes(ENABLE_CMOS);
+	
+	// UART1 is there on carts that have its pins wired
+	dserial_num_ports = dseUartEnabled(UART1) ? 2 : 1;
+	
+	for(port = 0; port < dserial_num_ports; port++) {
+		p = &dserial_ports[port];
+		midi_parser_init(&p->parser);
+		midi_queue_init(&p->queue);
+		p->fifo_head = p->fifo_tail = 0;
+		p->rt_head = p->rt_tail = 0;
+		p->rt_recent = 0;
+		p->sending = 0;
+		p->stalled = 0;
+		p->fifo_drops = 0;
+		p->tx_size = 0;
+	}
+	
+	dseUartSetBaudrate(UART0, 31250); // MIDI baud rate
+	dseUartSetReceiveHandler(UART0, dsmi_uart_recv);
+	dseUartSetSendHandler(UART0, dsmi_uart_sent);
+	
+	if(dserial_num_ports > 1) {
+		dseUartSetBaudrate(UART1, 31250);
+		dseUartSetReceiveHandler(UART1, dsmi_uart1_recv);
+		dseUartSetSendHandler(UART1, dsmi_uart1_sent);
+	}
+	
+	cardSpiSetHandler(dsmi_dserial_irq);
+	
+	// Card interrupts and sends are queued on a timer if one is free,
+	// otherwise DSerial is driven synchronously as before
+	dserial_async = dseAsyncInit();
+	analog_pass = ANALOG_IDLE;
+	
+	dsmi_select_interface(DSMI_SERIAL);
+
+	dserial_enabled = 1;
+	
+	return 1;
+}
+
+// ------------ WRITE ------------ //
+
+// Force a MIDI message to be sent over DSerial
+extern void dsmi_write_dserial(u8 message,u8 data1, u8 data2)
+{
+	dsmi_write_dserial_port(0, message, data1, data2);
+}
+
+// Sends a MIDI message over one of the DSerial ports
+extern void dsmi_write_dserial_port(int port, u8 message, u8 data1, u8 data2)
+{
+	dserial_port* p = dsmi_dserial_port(port);
+	u8 sendbuf[3];
+	int size;
+	DSMI_HIST_DECL(start);
+
+	if(p == NULL)
+		return;
+
+	DSMI_HIST_BEGIN(start);
+
+	DSMI_COUNT(iface[DSMI_SERIAL].msgs_out, 1);
+	size = dsmi_pack_serial(sendbuf, message, data1, data2);
+
+	if(!dsmi_batching) {
+		dsmi_dserial_send(port, sendbuf, size);
+	} else {
+		// one SPI write carries at most MAX_DATA_SIZE bytes
+		if(p->tx_size + size > MAX_DATA_SIZE) {
+			dsmi_dserial_send(port, p->tx, p->tx_size);
+			p->tx_size = 0;
+		}
+		memcpy(p->tx + p->tx_size, sendbuf, size);
+		p->tx_size += size;
+	}
+
+	DSMI_HIST_END(DSMI_HIST_WRITE_DSERIAL, start);
+}
+
+// Writes n messages as one batch, inside dsmi_write_begin/commit they
+// go out with the rest
+void dsmi_write_batch_dserial(const dsmi_msg* msgs, int n)
+{
+	dsmi_write_batch_dserial_port(0, msgs, n);
+}
+
+extern void dsmi_write_batch_dserial_port(int port, const dsmi_msg* msgs, int n)
+{
+	int nested = dsmi_batching;
+	int i;
+
+	dsmi_batching = 1;
+	for(i = 0; i < n; i++)
+		dsmi_write_dserial_port(port, msgs[i].message, msgs[i].data1, msgs[i].data2);
+	dsmi_batching = nested;
+
+	if(!nested)
+		dsmi_flush_dserial();
+}
+
+// Realtime messages take the realtime lane, so they don't wait for
+// queued output
+extern void dsmi_sync_write_dserial(u8 message)
+{
+	dsmi_sync_write_dserial_port(0, message);
+}
+
+extern void dsmi_sync_write_dserial_port(int port, u8 message)
+{
+	if(dsmi_dserial_port(port) == NULL)
+		return;
+
+	DSMI_COUNT(iface[DSMI_SERIAL].msgs_out, 1);
+
+	if(message < 0xF8)
+		dsmi_dserial_send(port, &message, 1);
+	else
+		dsmi_dserial_enqueue_rt(port, message);
+}
+
+// Returns the number of DSerial MIDI ports that are set up
+extern int dsmi_dserial_ports(void)
+{
+	return dserial_enabled ? dserial_num_ports : 0;
+}
+
+// Returns the number of bytes waiting in the UART0 transmit queue
+extern int dsmi_dserial_tx_pending(void)
+{
+	return dsmi_dserial_tx_pending_port(0);
+}
+
+extern int dsmi_dserial_tx_pending_port(int port)
+{
+	dserial_port* p = dsmi_dserial_port(port);
+
+	if(p == NULL)
+		return 0;
+	return (u16)(p->fifo_tail - p->fifo_head);
+}
+
+// Returns the number of writes dropped because a transmit queue was full
+extern u32 dsmi_dserial_tx_drops(void)
+{
+	return dserial_ports[0].fifo_drops + dserial_ports[1].fifo_drops;
+}
+
+// ------------ ANALOG CC MAPPING ------------ //
+
+extern int dsmi_analog_map(u8 port, u8 pin, u8 channel, u8 cc, int deadband)
+{
+	analog_map* m;
+
+	if(port < 1 || port > 2 || pin > 7 || channel > 15 || cc > 127 || deadband < 0)
+		return 0;
+
+	// pins outside of the ADC sequence are never read
+	if(dseAnalogSequenceIndex(port, pin) < 0)
+		return 0;
+
+	m = &analog[(port - 1) * 8 + pin];
+	if(!m->mapped)
+		analog_mapped++;
+	m->mapped = 1;
+	m->channel = channel;
+	m->cc = cc;
+	m->value = 0xFF;
+	m->raw = 0;
+	m->deadband = deadband;
+
+	return 1;
+}
+
+extern void dsmi_analog_unmap(u8 port, u8 pin)
+{
+	analog_map* m;
+
+	if(port < 1 || port > 2 || pin > 7)
+		return;
+
+	m = &analog[(port - 1) * 8 + pin];
+	if(m->mapped)
+		analog_mapped--;
+	m->mapped = 0;
+}
+
+// Called from the interrupt once an async pass has read the pins
+static void dsmi_analog_read(uint8 count, void* user)
+{
+	analog_pass = ANALOG_DONE;
+}
+
+// Reads all analog pins and sends CCs for the mapped ones that moved
+extern int dsmi_analog_update(void)
+{
+	analog_map* m;
+	int i, diff, sent = 0;
+	int fresh;
+	u8 value;
+
+	if(!dserial_enabled || analog_mapped == 0)
+		return 0;
+
+	if(dserial_async) {
+		// the CCs of the last pass that finished are sent, and the next
+		// pass is started, without waiting for the bus
+		if(analog_pass == ANALOG_BUSY)
+			return 0;
+
+		fresh = analog_pass == ANALOG_DONE;
+		if(fresh)
+			memcpy(analog_values, analog_reading, sizeof(analog_values));
+
+		analog_pass = ANALOG_BUSY;
+		if(!dsePinReadAnalogAllAsync(analog_reading, dsmi_analog_read, NULL))
+			analog_pass = ANALOG_IDLE;
+
+		if(!fresh)
+			return 0;
+	} else
+		dsePinReadAnalogAll(analog_values);
+
+	for(i = 0; i < ANALOG_PINS; i++) {
+		m = &analog[i];
+		if(!m->mapped)
+			continue;
+
+		// the value only moves once it has left the deadband around the
+		// last one sent, so a pot sitting between two steps stays quiet
+		diff = analog_values[i] - m->raw;
+		if(m->value != 0xFF && diff <= m->deadband && -diff <= m->deadband)
+			continue;
+
+		m->raw = analog_values[i];
+		value = m->raw >> (ANALOG_BITS - 7);
+		if(value > 127)
+			value = 127;
+		if(value == m->value)
+			continue;
+
+		m->value = value;
+		dsmi_write(MIDI_CC | m->channel, m->cc, value);
+		sent++;
+	}
+
+	return sent;
+}
+
+// ------------ SYSEX ------------ //
+
+// Queues as much of a SysEx as fits into the transmit queue and returns
+// the number of bytes taken, the realtime lane still goes ahead of it
+extern int dsmi_sysex_write_dserial(const u8* data, int size)
+{
+	int oldIME;
+	int n;
+
+	if(size <= 0)
+		return 0;
+
+	// the receiver forgets the running status on the F0, and the batched
+	// messages have to go out before the SysEx
+	dsmi_running_status_reset(DSMI_SERIAL);
+	dsmi_flush_dserial();
+
+	oldIME = enterCriticalSection();
+	n = DSERIAL_FIFO_SIZE - (u16)(dserial_ports[0].fifo_tail - dserial_ports[0].fifo_head);
+	if(n > size)
+		n = size;
+	if(n > 0)
+		dsmi_dserial_enqueue(0, data, n);
+	leaveCriticalSection(oldIME);
+
+	return n;
+}
+
+// ------------ READ ------------ //
+
+// Force receiving over DSerial
+extern int dsmi_read_dserial(u8* message, u8* data1, u8* data2)
+{
+	return dsmi_read_dserial_port(0, message, data1, data2);
+}
+
+// Receives over one of the DSerial ports
+extern int dsmi_read_dserial_port(int port, u8* message, u8* data1, u8* data2)
+{
+	dserial_port* p = dsmi_dserial_port(port);
+	dsmi_msg msg;
+
+	if(p == NULL || !midi_queue_pop(&p->queue, &msg))
+		return 0;
+
+	*message = msg.message;
+	*data1 = msg.data1;
+	*data2 = msg.data2;
+
+	return 1;
+}
+
+const dsmi_transport dsmi_dserial_transport = {
+	DSMI_SERIAL,
+	&dserial_enabled,
+	&dserial_ports[0].parser,
+	dsmi_write_dserial,
+	dsmi_write_now_dserial,
+	dsmi_write_batch_dserial,
+	dsmi_write_now_batch_dserial,
+	dsmi_sync_write_dserial,
+	dsmi_read_dserial,
+	dsmi_sysex_write_dserial,
+	dsmi_flush_dserial,
+	dsmi_dserial_frame
+};
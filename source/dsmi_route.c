@@ -0,0 +1,184 @@
+//    Forwarding between interfaces. Received messages are matched against
+//    the routing table in the receive path (the receive interrupt for
+//    DSerial and DSBrut) and collected per output. What came in at once
+//    is written at once to the serial outputs. Wifi can't be sent to from
+//    an interrupt, its share waits for dsmi_flush on the main thread.
+
+#include <nds.h>
+
+#include "libdsmi.h"
+#include "dsmi_internals.h"
+
+#define ROUTE_BURST	16	// messages collected per output before they are written
+
+typedef struct {
+	u8 used;
+	u8 from;
+	u8 to;
+	u16 channels;	// bit n for MIDI channel n + 1
+	u16 types;		// DSMI_ROUTE_* bits
+} dsmi_route_entry;
+
+static dsmi_route_entry routes[DSMI_ROUTES];
+
+// Messages forwarded during the current receive burst, by input and
+// output. The receive interrupts don't nest and wifi is received outside
+// of them, so every input has its own.
+static dsmi_msg burst[3][3][ROUTE_BURST];
+static int burst_size[3][3];
+
+volatile int dsmi_routed_from = 0;
+
+// ------------ PRIVATE ------------ //
+
+// DSMI_ROUTE_* bit of a status byte
+static inline u16 dsmi_route_type(u8 message)
+{
+	if(message >= 0xF8)
+		return DSMI_ROUTE_REALTIME;
+	if(message < 0x80)
+		return 0;
+	return 1 << ((message >> 4) - 8);
+}
+
+// Has to be called with interrupts disabled
+static void dsmi_route_update(void)
+{
+	int mask = 0;
+	int i;
+
+	for(i = 0; i < DSMI_ROUTES; i++) {
+		if(routes[i].used)
+			mask |= 1 << routes[i].from;
+	}
+	dsmi_routed_from = mask;
+}
+
+// Writes messages to an output that is connected, outputs that aren't
+// (yet) drop what is routed to them
+static void dsmi_route_write(int to, const dsmi_msg* msgs, int n)
+{
+	const dsmi_transport* t = dsmi_transport_of(to);
+
+	if(t == NULL || !*t->enabled)
+		return;
+
+#ifndef DSMI_NO_WIFI
+	// wifi is only routed to from the receive interrupts
+	if(to == DSMI_WIFI) {
+		dsmi_wifi_defer(msgs, n);
+		return;
+	}
+#endif
+
+	if(n == 1 && msgs[0].message >= 0xF8)
+		t->sync_write(msgs[0].message);
+	else
+		t->write_now_batch(msgs, n);
+}
+
+static void dsmi_route_send(int from, int to)
+{
+	dsmi_route_write(to, burst[from][to], burst_size[from][to]);
+	burst_size[from][to] = 0;
+}
+
+int dsmi_route_msg(int from, const dsmi_msg* msg)
+{
+	const dsmi_route_entry* r;
+	u16 type = dsmi_route_type(msg->message);
+	int deliver = 1;
+	int i, to;
+
+	for(i = 0; i < DSMI_ROUTES; i++) {
+		r = &routes[i];
+		if(!r->used || r->from != from || !(r->types & type))
+			continue;
+		if(msg->message < 0xF0 && !(r->channels & (1 << (msg->message & 0x0F))))
+			continue;
+
+		if(r->types & DSMI_ROUTE_ONLY)
+			deliver = 0;
+
+		to = r->to;
+		if(type == DSMI_ROUTE_REALTIME) {
+			// takes the realtime lane right away
+			dsmi_route_write(to, msg, 1);
+			continue;
+		}
+
+		if(burst_size[from][to] == ROUTE_BURST)
+			dsmi_route_send(from, to);
+		burst[from][to][burst_size[from][to]++] = *msg;
+	}
+
+	return deliver;
+}
+
+void dsmi_route_commit(int from)
+{
+	int to;
+
+	for(to = 0; to < 3; to++) {
+		if(burst_size[from][to] > 0)
+			dsmi_route_send(from, to);
+	}
+}
+
+// ------------ ROUTING ------------ //
+
+extern int dsmi_route_add(int from, int to, u16 channels, u16 types)
+{
+	dsmi_route_entry* r;
+	int oldIME;
+	int i;
+
+	if(from == to || dsmi_transport_of(from) == NULL || dsmi_transport_of(to) == NULL)
+		return -1;
+
+	oldIME = enterCriticalSection();
+
+	for(i = 0; i < DSMI_ROUTES; i++) {
+		r = &routes[i];
+		if(r->used)
+			continue;
+
+		r->from = from;
+		r->to = to;
+		r->channels = channels;
+		r->types = types;
+		r->used = 1;
+		dsmi_route_update();
+
+		leaveCriticalSection(oldIME);
+		return i;
+	}
+
+	leaveCriticalSection(oldIME);
+	return -1;
+}
+
+extern void dsmi_route_remove(int route)
+{
+	int oldIME;
+
+	if(route < 0 || route >= DSMI_ROUTES)
+		return;
+
+	oldIME = enterCriticalSection();
+	routes[route].used = 0;
+	dsmi_route_update();
+	leaveCriticalSection(oldIME);
+}
+
+extern void dsmi_route_clear(void)
+{
+	int oldIME = enterCriticalSection();
+	int i;
+
+	for(i = 0; i < DSMI_ROUTES; i++)
+		routes[i].used = 0;
+	dsmi_route_update();
+
+	leaveCriticalSection(oldIME);
+}
@@ -0,0 +1,176 @@
+//    Timestamped MIDI output. Events wait in a binary min-heap ordered
+//    by time and are sent from the clock alarm interrupt when they are
+//    due, independent of when the application gets to run.
+
+#include <nds.h>
+
+#include "libdsmi.h"
+#include "dsmi_clock.h"
+#include "dsmi_internals.h"
+
+#ifndef DSMI_SCHEDULE_SIZE
+#define DSMI_SCHEDULE_SIZE 128	// number of events that can be pending
+#endif
+
+typedef struct {
+	u32 time;
+	u16 seq;		// keeps events with the same time in scheduling order
+	u8 interface;
+	u8 sync;		// sent with dsmi_sync_write
+	u8 message;
+	u8 data1;
+	u8 data2;
+} dsmi_event;
+
+static dsmi_event heap[DSMI_SCHEDULE_SIZE];
+static int heap_size = 0;
+static u16 next_seq = 0;
+static int schedule_ready = 0;
+
+static inline int dsmi_event_before(const dsmi_event* a, const dsmi_event* b)
+{
+	s32 diff = a->time - b->time;
+
+	if(diff != 0)
+		return diff < 0;
+
+	return (s16)(a->seq - b->seq) < 0;
+}
+
+static void dsmi_heap_push(const dsmi_event* ev)
+{
+	int i = heap_size++;
+
+	while(i > 0) {
+		int parent = (i - 1) / 2;
+		if(!dsmi_event_before(ev, &heap[parent]))
+			break;
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = *ev;
+}
+
+static void dsmi_heap_pop(dsmi_event* ev)
+{
+	dsmi_event last;
+	int i = 0;
+
+	*ev = heap[0];
+	last = heap[--heap_size];
+
+	while(1) {
+		int child = 2 * i + 1;
+		if(child >= heap_size)
+			break;
+		if(child + 1 < heap_size && dsmi_event_before(&heap[child + 1], &heap[child]))
+			child++;
+		if(!dsmi_event_before(&heap[child], &last))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+}
+
+// Runs in the alarm interrupt
+static void dsmi_schedule_irq(void)
+{
+	dsmi_event ev;
+#ifndef DSMI_NO_WIFI
+	dsmi_msg msg;
+#endif
+	u32 now = dsmi_clock_ticks();
+
+	while(heap_size > 0 && (s32)(heap[0].time - now) <= 0) {
+		dsmi_heap_pop(&ev);
+#ifndef DSMI_NO_WIFI
+		// sendto can't be called from here, dsmi_flush sends it
+		if(ev.interface == DSMI_WIFI) {
+			msg.message = ev.message;
+			msg.data1 = ev.data1;
+			msg.data2 = ev.data2;
+			dsmi_wifi_defer(&msg, 1);
+			continue;
+		}
+#endif
+		if(ev.sync)
+			dsmi_sync_write_now(ev.interface, ev.message);
+		else
+			dsmi_write_now(ev.interface, ev.message, ev.data1, ev.data2);
+	}
+
+	if(heap_size > 0)
+		dsmi_clock_set_alarm(heap[0].time);
+}
+
+static int dsmi_schedule_add(u32 time, int sync, u8 message, u8 data1, u8 data2)
+{
+	dsmi_event ev;
+	int oldIME;
+
+	if(!schedule_ready) {
+		if(!dsmi_clock_alarm_init(dsmi_schedule_irq))
+			return 0;
+		schedule_ready = 1;
+	}
+
+	ev.time = time;
+	ev.interface = dsmi_get_default_interface();
+	ev.sync = sync;
+	ev.message = message;
+	ev.data1 = data1;
+	ev.data2 = data2;
+
+	oldIME = enterCriticalSection();
+
+	if(heap_size == DSMI_SCHEDULE_SIZE) {
+		leaveCriticalSection(oldIME);
+		return 0;
+	}
+
+	ev.seq = next_seq++;
+	dsmi_heap_push(&ev);
+
+	// the new event is the next one due
+	if(heap[0].seq == ev.seq)
+		dsmi_clock_set_alarm(time);
+
+	leaveCriticalSection(oldIME);
+
+	return 1;
+}
+
+// ------------ SCHEDULED WRITE ------------ //
+
+extern u32 dsmi_get_time(void)
+{
+	dsmi_clock_init();
+
+	return dsmi_clock_ticks();
+}
+
+extern int dsmi_schedule_write(u32 time, u8 message, u8 data1, u8 data2)
+{
+	return dsmi_schedule_add(time, 0, message, data1, data2);
+}
+
+extern int dsmi_schedule_sync_write(u32 time, u8 message)
+{
+	return dsmi_schedule_add(time, 1, message, 0, 0);
+}
+
+extern int dsmi_schedule_pending(void)
+{
+	return heap_size;
+}
+
+extern void dsmi_schedule_clear(void)
+{
+	int oldIME = enterCriticalSection();
+
+	heap_size = 0;
+	dsmi_clock_cancel_alarm();
+
+	leaveCriticalSection(oldIME);
+}
@@ -0,0 +1,101 @@
+//    Transport counters and timing histograms. The counters are bumped
+//    in place by the transports, dsmi_get_stats copies them out.
+
+#include <nds.h>
+#include <string.h>
+
+#include "libdsmi.h"
+#include "dsmi_stats.h"
+#ifndef DSMI_NO_DSBRUT
+#include "uart.h"
+#endif
+
+#ifndef DSMI_NO_STATS
+
+dsmi_stats dsmi_counters;
+u8 dsmi_hist_timer = DSMI_HIST_OFF;
+
+void dsmi_hist_add(int id, u16 ticks)
+{
+	dsmi_histogram* hist = &dsmi_counters.hist[id];
+	int bin = ticks ? 31 - __builtin_clz(ticks) : 0;
+	int oldIME = enterCriticalSection();
+
+	hist->calls++;
+	hist->bins[bin]++;
+	if(ticks > hist->max)
+		hist->max = ticks;
+
+	leaveCriticalSection(oldIME);
+}
+
+extern void dsmi_get_stats(dsmi_stats* stats)
+{
+	int oldIME = enterCriticalSection();
+
+	memcpy(stats, &dsmi_counters, sizeof(dsmi_stats));
+
+	leaveCriticalSection(oldIME);
+
+#ifndef DSMI_NO_DSBRUT
+	// the DSBrut irqs are counted by the uart code anyway
+	uart_get_irq_count(&stats->timer_irqs, &stats->line_irqs);
+#endif
+}
+
+extern void dsmi_reset_stats(void)
+{
+	int oldIME = enterCriticalSection();
+
+	memset(&dsmi_counters, 0, sizeof(dsmi_stats));
+
+	leaveCriticalSection(oldIME);
+}
+
+extern int dsmi_enable_histograms(int enable)
+{
+	int i;
+
+	if(!enable) {
+		if(dsmi_hist_timer != DSMI_HIST_OFF) {
+			TIMER_CR(dsmi_hist_timer) = 0;
+			dsmi_hist_timer = DSMI_HIST_OFF;
+		}
+		return 1;
+	}
+
+	if(dsmi_hist_timer != DSMI_HIST_OFF)
+		return 1;
+
+	// TIMER3 is used by the wifi code
+	for(i = 2; 0 <= i; i--) {
+		if(TIMER_CR(i) & TIMER_ENABLE)
+			continue;
+
+		// no irq, the 16 bit counter is only ever read as a difference
+		TIMER_DATA(i) = 0;
+		TIMER_CR(i) = TIMER_DIV_1 | TIMER_ENABLE;
+		dsmi_hist_timer = i;
+		return 1;
+	}
+
+	return 0;
+}
+
+#else
+
+extern void dsmi_get_stats(dsmi_stats* stats)
+{
+	memset(stats, 0, sizeof(dsmi_stats));
+}
+
+extern void dsmi_reset_stats(void)
+{
+}
+
+extern int dsmi_enable_histograms(int enable)
+{
+	return !enable;
+}
+
+#endif // DSMI_NO_STATS
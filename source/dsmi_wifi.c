@@ -0,0 +1,735 @@
+//    Wifi transport. MIDI goes to DSMIDIWiFi on the PC as UDP datagrams,
+//    OSC is sent and received on ports of its own.
+
+#include <nds.h>
+#include <string.h>
+
+#include <dswifi9.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "libdsmi.h"
+#include "osc_client.h"
+#include "osc_server.h"
+#include "midi_parser.h"
+#include "dsmi_clock.h"
+#include "dsmi_stats.h"
+#include "dsmi_internals.h"
+
+#define PC_PORT		9000
+#define DS_PORT		9001
+#define DS_SENDER_PORT	9002
+#define DS_OSC_PORT	9003
+
+#define WIFI_TX_SIZE		384	// bytes per datagram while batching, multiple of 3
+#define WIFI_RX_SIZE		512	// largest datagram received, longer ones are cut off
+#define WIFI_NOW_SIZE		96	// bytes per datagram from dsmi_write_now_batch_wifi, multiple of 3
+#define WIFI_PEER_TIMEOUT	200	// 50ms ticks without packets before broadcasting again
+
+#define WIFI_PEER_BROADCAST	0
+#define WIFI_PEER_LEARNED	1
+#define WIFI_PEER_FIXED		2
+
+int sock, sockin, sockosc;
+struct sockaddr_in addr_out_from, addr_out_to, addr_in;
+
+OSCbuf osc_buffer;
+
+// While a bundle is open, dsmi_osc_send adds to it instead of sending
+static OSCbundle osc_bundle;
+static int osc_bundling = 0;
+static unsigned int osc_bundle_sec, osc_bundle_frac;
+static int osc_bundle_auto = 0;		// the open bundle was started by coalescing
+
+// Incoming OSC, received on its own port so it doesn't mix with MIDI
+static OSCserver osc_server;
+static int osc_server_ready = 0;
+static u32 osc_recbuf[OSC_MAX_BUNDLE_SIZE / 4];
+
+char recbuf[WIFI_RX_SIZE];
+
+int in_size;
+struct sockaddr_in in;
+
+// Whole datagrams are split into messages here, emptied by dsmi_read_wifi
+static midi_parser wifi_parser;
+static midi_queue wifi_queue;
+
+// Output from interrupts (routes, the scheduler), sendto must not be
+// called there. Sent from dsmi_wifi_poll on the main thread.
+static midi_queue wifi_deferred;
+static int wifi_rx_mode = DSMI_WIFI_RX_RECORDS;
+
+// Output is broadcast until a packet arrives, then sent to its sender
+static unsigned long wifi_bcast_ip;
+static volatile int wifi_peer = WIFI_PEER_BROADCAST;
+static volatile int wifi_peer_idle = 0;
+
+int wifi_enabled = 0;
+
+// Messages collected between dsmi_write_begin and dsmi_write_commit,
+// or while coalescing
+static char wifi_tx[WIFI_TX_SIZE];
+static int wifi_tx_size = 0;
+
+// Wifi coalescing collects output in wifi_tx (and OSC in an automatic
+// bundle) until the window has passed, see dsmi_set_wifi_coalescing
+static int wifi_coalescing = 0;
+static u32 wifi_coalesce_window = 0;	// in clock ticks, 0 to wait for dsmi_flush
+static int wifi_coalesce_pending = 0;
+static u32 wifi_coalesce_since;
+
+// The 50ms timer only flags the keepalive, it is sent from the main thread
+static volatile int wifi_keepalive_due = 0;
+static volatile int wifi_tx_activity = 0;
+
+static void dsmi_osc_flush_auto(void);
+static void dsmi_wifi_drain(void);
+
+extern void wifiValue32Handler(u32 value, void* data);
+extern void arm9_synctoarm7();
+
+// ------------ PRIVATE ------------ //
+
+// Every datagram to the peer goes out through here
+static int dsmi_wifi_send(const void* data, int size)
+{
+	int res;
+
+	wifi_tx_activity = 1;
+	res = sendto(sock, data, size, 0, (struct sockaddr*)&addr_out_to, sizeof(addr_out_to));
+
+	if(res < 0)
+		DSMI_COUNT(iface[DSMI_WIFI].drops_out, 1);
+	else if(res < size)
+		DSMI_COUNT(iface[DSMI_WIFI].short_writes, 1);
+	else
+		DSMI_COUNT(iface[DSMI_WIFI].bytes_out, size);
+	return res;
+}
+
+void dsmi_flush_wifi(void)
+{
+	if(wifi_tx_size > 0) {
+		dsmi_wifi_send(wifi_tx, wifi_tx_size);
+		wifi_tx_size = 0;
+	}
+}
+
+// The coalescing window starts with the first message collected
+static void dsmi_coalesce_hold(void)
+{
+	if(!wifi_coalesce_pending) {
+		wifi_coalesce_pending = 1;
+		wifi_coalesce_since = dsmi_clock_ticks();
+	}
+}
+
+static void dsmi_coalesce_flush(void)
+{
+	wifi_coalesce_pending = 0;
+	
+	// inside dsmi_write_begin/commit, the messages go out on commit
+	if(!dsmi_batching)
+		dsmi_flush_wifi();
+	dsmi_osc_flush_auto();
+}
+
+// Sends the output deferred from interrupts, whatever came in between
+// realtime messages goes as one datagram
+static void dsmi_wifi_send_deferred(void)
+{
+	dsmi_msg msgs[WIFI_NOW_SIZE / 3];
+	dsmi_msg msg;
+	int n = 0;
+
+	while(midi_queue_pop(&wifi_deferred, &msg)) {
+		if(msg.message >= 0xF8) {
+			if(n > 0)
+				dsmi_write_now_batch_wifi(msgs, n);
+			n = 0;
+			dsmi_sync_write_wifi(msg.message);
+			continue;
+		}
+		msgs[n++] = msg;
+		if(n == WIFI_NOW_SIZE / 3) {
+			dsmi_write_now_batch_wifi(msgs, n);
+			n = 0;
+		}
+	}
+	if(n > 0)
+		dsmi_write_now_batch_wifi(msgs, n);
+}
+
+// Wifi work that must not be done in the timer interrupt
+static void dsmi_wifi_poll(void)
+{
+	char beacon[3] = {0, 0, 0};
+	
+	if(midi_queue_count(&wifi_deferred) > 0)
+		dsmi_wifi_send_deferred();
+	
+	if(wifi_coalesce_pending && wifi_coalesce_window != 0
+	   && dsmi_clock_ticks() - wifi_coalesce_since >= wifi_coalesce_window)
+		dsmi_coalesce_flush();
+	
+	if(wifi_keepalive_due) {
+		wifi_keepalive_due = 0;
+		dsmi_wifi_send(beacon, 3);
+	}
+}
+
+void dsmi_write_now_wifi(u8 message, u8 data1, u8 data2)
+{
+	char sendbuf[3] = {message, data1, data2};
+
+	DSMI_COUNT(iface[DSMI_WIFI].msgs_out, 1);
+	dsmi_wifi_send(sendbuf, 3);
+}
+
+// Sends n messages as one datagram, bypassing batching and coalescing
+void dsmi_write_now_batch_wifi(const dsmi_msg* msgs, int n)
+{
+	char buf[WIFI_NOW_SIZE];
+	int size = 0;
+	int i;
+
+	DSMI_COUNT(iface[DSMI_WIFI].msgs_out, n);
+	for(i = 0; i < n; i++) {
+		if(size + 3 > WIFI_NOW_SIZE) {
+			dsmi_wifi_send(buf, size);
+			size = 0;
+		}
+		buf[size++] = msgs[i].message;
+		buf[size++] = msgs[i].data1;
+		buf[size++] = msgs[i].data2;
+	}
+	if(size > 0)
+		dsmi_wifi_send(buf, size);
+}
+
+// Sends coalesced output and a pending keepalive, from dsmi_flush. Input
+// that is routed elsewhere is forwarded from here too.
+static void dsmi_wifi_frame(void)
+{
+	if(dsmi_routed_from & (1 << DSMI_WIFI))
+		dsmi_wifi_drain();
+	if(wifi_coalesce_pending)
+		dsmi_coalesce_flush();
+	dsmi_wifi_poll();
+}
+
+// ------------ SETUP ------------ //
+
+void dsmi_timer_50ms(void) {
+    Wifi_Timer(50);
+
+    // The peer went quiet, fall back to broadcast so it can be found again
+    if(wifi_peer == WIFI_PEER_LEARNED && ++wifi_peer_idle >= WIFI_PEER_TIMEOUT)
+    {
+        addr_out_to.sin_addr.s_addr = wifi_bcast_ip;
+        wifi_peer = WIFI_PEER_BROADCAST;
+    }
+
+    if(wifi_enabled == 1 && default_interface == DSMI_WIFI)
+    {
+        // Ask for a keepalive beacon after 3 seconds without other output
+        static u8 counter = 0;
+        if(wifi_tx_activity)
+        {
+            wifi_tx_activity = 0;
+            counter = 0;
+        }
+        counter++;
+        if(counter == 60)
+        {
+            counter = 0;
+            wifi_keepalive_due = 1;
+        }
+    }
+}
+
+// Starts the wifi library with the custom timer handler, without waiting for it
+bool dsmi_wifi_start(void) {
+    fifoSetValue32Handler(FIFO_DSWIFI,  wifiValue32Handler, 0);
+
+    u32 wifi_pass = Wifi_Init(WIFIINIT_OPTION_USELED);
+
+    if(!wifi_pass) return false;
+
+    irqSet(IRQ_TIMER3, dsmi_timer_50ms); // setup timer IRQ
+    irqEnable(IRQ_TIMER3);
+
+    Wifi_SetSyncHandler(arm9_synctoarm7); // tell wifi lib to use our handler to notify arm7
+
+    // set timer3
+    TIMER3_DATA = -6553; // 6553.1 * 256 cycles = ~50ms;
+    TIMER3_CR = 0x00C2; // enable, irq, 1/256 clock
+
+    fifoSendAddress(FIFO_DSWIFI, (void *)wifi_pass);
+
+    return true;
+}
+
+// Modified version of dswifi's init function that uses a custom timer handler
+// In addition to calling Wifi_Timer, new new handler also sends the DSMI keepalive
+// beacon.
+bool dsmi_wifi_init(void) {
+    if(!dsmi_wifi_start()) return false;
+
+    while(Wifi_CheckInit()==0) {
+        swiWaitForVBlank();
+    }
+
+    int wifiStatus = ASSOCSTATUS_DISCONNECTED;
+
+    Wifi_AutoConnect(); // request connect
+
+    while(wifiStatus != ASSOCSTATUS_ASSOCIATED) {
+        wifiStatus = Wifi_AssocStatus(); // check status
+
+        if(wifiStatus == ASSOCSTATUS_CANNOTCONNECT) return false;
+        swiWaitForVBlank();
+
+    }
+
+    return true;    
+}
+
+extern int dsmi_connect_wifi(void)
+{
+    Wifi_EnableWifi();
+
+	if(!dsmi_wifi_init()) {
+        Wifi_DisableWifi();
+		return 0;
+	}
+	
+	int i = Wifi_AssocStatus();
+	if(i == ASSOCSTATUS_CANNOTCONNECT) {
+		Wifi_DisableWifi();
+		return 0;
+	} else if(i == ASSOCSTATUS_ASSOCIATED) {
+		dsmi_wifi_open();
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+// Sets up the sockets once associated
+void dsmi_wifi_open(void)
+{
+	sock = socket(AF_INET, SOCK_DGRAM, 0); // setup socket for DGRAM (UDP), returns with a socket handle
+	sockin = socket(AF_INET, SOCK_DGRAM, 0);
+	sockosc = socket(AF_INET, SOCK_DGRAM, 0);
+	
+	// Source
+	addr_out_from.sin_family = AF_INET;
+	addr_out_from.sin_port = htons(DS_SENDER_PORT);
+	addr_out_from.sin_addr.s_addr = INADDR_ANY;
+	
+	// Destination
+	addr_out_to.sin_family = AF_INET;
+	addr_out_to.sin_port = htons(PC_PORT);
+	
+	struct in_addr gateway, snmask, dns1, dns2;
+	Wifi_GetIPInfo(&gateway, &snmask, &dns1, &dns2);
+
+	unsigned long my_ip = Wifi_GetIP(); // Set IP to broadcast IP
+	unsigned long bcast_ip = my_ip | ~snmask.s_addr;
+	
+	addr_out_to.sin_addr.s_addr = bcast_ip;
+	wifi_bcast_ip = bcast_ip;
+	wifi_peer = WIFI_PEER_BROADCAST;
+	
+	// Receiver
+	addr_in.sin_family = AF_INET;
+	addr_in.sin_port = htons(DS_PORT);
+	addr_in.sin_addr.s_addr = INADDR_ANY;
+	
+	bind(sock, (struct sockaddr*)&addr_out_from, sizeof(addr_out_from));
+	bind(sockin, (struct sockaddr*)&addr_in, sizeof(addr_in));
+	
+	addr_in.sin_port = htons(DS_OSC_PORT);
+	bind(sockosc, (struct sockaddr*)&addr_in, sizeof(addr_in));
+	addr_in.sin_port = htons(DS_PORT);
+	
+	u8 val = 1;
+	ioctl(sockin, FIONBIO, (char*)&val);  // Enable non-blocking I/O
+	ioctl(sockosc, FIONBIO, (char*)&val);
+	
+	midi_parser_init(&wifi_parser);
+	midi_queue_init(&wifi_queue);
+	midi_queue_init(&wifi_deferred);
+	
+	dsmi_select_interface(DSMI_WIFI);
+	wifi_enabled = 1;
+}
+
+// ------------ WRITE ------------ //
+
+// Force a MIDI message to be sent over Wifi
+extern void dsmi_write_wifi(u8 message,u8 data1, u8 data2)
+{
+	char sendbuf[3] = {message, data1, data2};
+	DSMI_HIST_DECL(start);
+
+	DSMI_HIST_BEGIN(start);
+
+	if(!dsmi_batching && !wifi_coalescing) {
+		dsmi_write_now_wifi(message, data1, data2);
+	} else {
+		DSMI_COUNT(iface[DSMI_WIFI].msgs_out, 1);
+
+		// the server expects 3 bytes per message, so a datagram carries
+		// a whole number of them
+		if(wifi_tx_size + 3 > WIFI_TX_SIZE)
+			dsmi_flush_wifi();
+		memcpy(wifi_tx + wifi_tx_size, sendbuf, 3);
+		wifi_tx_size += 3;
+
+		if(!dsmi_batching) {
+			dsmi_coalesce_hold();
+			dsmi_wifi_poll();
+		}
+	}
+
+	DSMI_HIST_END(DSMI_HIST_WRITE_WIFI, start);
+}
+
+
+// Collects wifi output for window_ms milliseconds before sending it
+extern int dsmi_set_wifi_coalescing(int window_ms)
+{
+	if(wifi_coalesce_pending)
+		dsmi_coalesce_flush();
+	wifi_coalescing = 0;
+
+	if(window_ms == 0)
+		return 1;
+	if(window_ms > 0 && !dsmi_clock_init())
+		return 0;
+
+	wifi_coalesce_window = window_ms > 0 ? DSMI_CLOCK_MS(window_ms) : 0;
+	wifi_coalescing = 1;
+	return 1;
+}
+
+// Writes n messages as one batch, inside dsmi_write_begin/commit they
+// go out with the rest
+void dsmi_write_batch_wifi(const dsmi_msg* msgs, int n)
+{
+	int nested = dsmi_batching;
+	int i;
+
+	dsmi_batching = 1;
+	for(i = 0; i < n; i++)
+		dsmi_write_wifi(msgs[i].message, msgs[i].data1, msgs[i].data2);
+	dsmi_batching = nested;
+
+	if(!nested)
+		dsmi_flush_wifi();
+}
+
+// Realtime messages are never batched on wifi
+extern void dsmi_sync_write_wifi(u8 message)
+{
+	DSMI_COUNT(iface[DSMI_WIFI].msgs_out, 1);
+	dsmi_wifi_send(&message, 1);
+}
+
+// ------------ SYSEX ------------ //
+
+// Sends a SysEx as datagrams of raw bytes no bigger than a DS receives
+// in one piece, returns the number of bytes sent
+extern int dsmi_sysex_write_wifi(const u8* data, int size)
+{
+	int n = 0;
+	int chunk;
+
+	if(size <= 0)
+		return 0;
+
+	// the batched messages have to go out before the SysEx
+	dsmi_flush_wifi();
+	while(n < size) {
+		chunk = size - n < WIFI_RX_SIZE ? size - n : WIFI_RX_SIZE;
+		if(dsmi_wifi_send(data + n, chunk) < 0)
+			break;
+		n += chunk;
+	}
+
+	return n;
+}
+
+// ------------ OSC WRITE ------------ //
+
+// Resets the OSC buffer and sets the destination open sound control address, returns 1 if ok, 0 if address string not valid
+extern int dsmi_osc_new( char* addr){
+
+  osc_init( &osc_buffer);
+  return osc_writeaddr( &osc_buffer, addr);
+  
+}
+
+// Adds arguments to the OSC packet
+extern int dsmi_osc_addintarg( long arg){
+
+  return osc_addintarg( &osc_buffer, arg);
+
+}
+extern int dsmi_osc_addstringarg( char* arg){
+
+  return osc_addstringarg( &osc_buffer, arg);
+}
+
+extern int dsmi_osc_addfloatarg( float arg){
+
+  return osc_addfloatarg( &osc_buffer, arg);
+
+}
+
+// Sends a packed OSC message, or adds it to the open bundle
+static int dsmi_osc_send_packet( char* msg, int size){
+
+  int res = size;
+  
+  // nothing was set up to send
+  if( size <= 0)
+    return 0;
+
+  // coalescing collects messages in a bundle of its own
+  if( !osc_bundling && wifi_coalescing && size + 20 <= OSC_MAX_BUNDLE_SIZE){
+    dsmi_osc_bundle_begin( 0, 1);
+    osc_bundle_auto = 1;
+  }
+
+  if( !osc_bundling || size + 20 > OSC_MAX_BUNDLE_SIZE)
+    return dsmi_wifi_send( msg, size);
+
+  // bundle full, send it and continue with a new one
+  if( !osc_bundle_fits( &osc_bundle, size)){
+    res = dsmi_osc_bundle_send();
+    osc_bundling = 1;
+    osc_bundle_init( &osc_bundle, osc_bundle_sec, osc_bundle_frac);
+  }
+
+  osc_bundle_add( &osc_bundle, msg, size);
+  if( osc_bundle_auto){
+    dsmi_coalesce_hold();
+    dsmi_wifi_poll();
+  }
+  return res;
+
+}
+
+// Sends the OSC packet
+extern int dsmi_osc_send(void){
+
+  char* msg = osc_getPacket( &osc_buffer);
+  int size = osc_getPacketSize( &osc_buffer);
+
+  return dsmi_osc_send_packet( msg, size);
+
+}
+
+// Sends an OSC template with its current slot values
+extern int dsmi_osc_template_send( OSCtemplate* tpl){
+
+  return dsmi_osc_send_packet( osc_template_getPacket( tpl), osc_template_getPacketSize( tpl));
+
+}
+
+// Starts collecting OSC messages into a bundle
+extern void dsmi_osc_bundle_begin( unsigned int sec, unsigned int frac){
+
+  // messages collected by coalescing go out before the new bundle
+  dsmi_osc_flush_auto();
+
+  osc_bundle_sec = sec;
+  osc_bundle_frac = frac;
+  osc_bundle_init( &osc_bundle, sec, frac);
+  osc_bundling = 1;
+
+}
+
+// Registers a handler for incoming OSC messages
+extern int dsmi_osc_add_handler( const char* address, OSChandler handler, void* user){
+
+  if( !osc_server_ready){
+    osc_server_init( &osc_server);
+    osc_server_ready = 1;
+  }
+  return osc_server_add( &osc_server, address, handler, user);
+
+}
+
+// Dispatches all received OSC packets, returns the number of handler calls
+extern int dsmi_osc_dispatch(void){
+
+  int size, res, calls = 0;
+
+  if( !wifi_enabled || !osc_server_ready) return 0;
+
+  while( (size = recvfrom( sockosc, (char*)osc_recbuf, sizeof( osc_recbuf), 0, NULL, NULL)) > 0){
+    res = osc_server_dispatch( &osc_server, (char*)osc_recbuf, size);
+    if( res > 0) calls += res;
+  }
+  return calls;
+
+}
+
+// Sends the bundle as one datagram and stops bundling
+extern int dsmi_osc_bundle_send(void){
+
+  osc_bundling = 0;
+  if( osc_bundle.numelems == 0) return 0;
+
+  return dsmi_wifi_send( osc_bundle_getPacket( &osc_bundle), osc_bundle_getPacketSize( &osc_bundle));
+
+}
+
+// Sends the bundle started by coalescing, if there is one
+static void dsmi_osc_flush_auto(void){
+
+  if( osc_bundle_auto){
+    osc_bundle_auto = 0;
+    if( osc_bundling) dsmi_osc_bundle_send();
+  }
+
+}
+
+// Queues messages for dsmi_wifi_poll, for callers in interrupts. The
+// interrupts don't nest, so there is only ever one producer.
+void dsmi_wifi_defer(const dsmi_msg* msgs, int n)
+{
+	int i;
+
+	for(i = 0; i < n; i++) {
+		if(!midi_queue_push(&wifi_deferred, &msgs[i]))
+			DSMI_COUNT(iface[DSMI_WIFI].drops_out, 1);
+	}
+}
+
+// ------------ READ ------------ //
+
+static void dsmi_wifi_push(const dsmi_msg* msg)
+{
+	if((dsmi_routed_from & (1 << DSMI_WIFI)) && !dsmi_route_msg(DSMI_WIFI, msg))
+		return;
+	if(midi_queue_push(&wifi_queue, msg))
+		DSMI_COUNT(iface[DSMI_WIFI].msgs_in, 1);
+	else
+		DSMI_COUNT(iface[DSMI_WIFI].drops_in, 1);
+}
+
+// Splits a received datagram into messages and queues them
+static void dsmi_wifi_recv(int size)
+{
+	dsmi_msg msg;
+	int i;
+	
+	DSMI_COUNT(iface[DSMI_WIFI].bytes_in, size);
+	if(wifi_rx_mode == DSMI_WIFI_RX_RECORDS) {
+		for(i = 0; i + 3 <= size; i += 3) {
+			msg.message = recbuf[i];
+			msg.data1 = recbuf[i+1];
+			msg.data2 = recbuf[i+2];
+			dsmi_wifi_push(&msg);
+		}
+	} else {
+		// Running status doesn't carry over from a lost datagram,
+		// but a SysEx can span datagrams
+		if(wifi_parser.status != 0xF0)
+			midi_parser_init(&wifi_parser);
+		for(i = 0; i < size; i++) {
+			if(midi_parse(&wifi_parser, recbuf[i], &msg))
+				dsmi_wifi_push(&msg);
+		}
+	}
+
+	// what came in one datagram goes on together
+	if(dsmi_routed_from & (1 << DSMI_WIFI))
+		dsmi_route_commit(DSMI_WIFI);
+}
+
+// Sends to whoever sent this packet from now on
+static void dsmi_wifi_learn_peer(void)
+{
+	wifi_peer_idle = 0;
+	if(wifi_peer == WIFI_PEER_FIXED)
+		return;
+	
+	addr_out_to.sin_addr.s_addr = in.sin_addr.s_addr;
+	wifi_peer = WIFI_PEER_LEARNED;
+}
+
+// Receives all pending datagrams, leaving the rest in the socket
+// once the queue is half full
+static void dsmi_wifi_drain(void)
+{
+	int res;
+	
+	while(midi_queue_count(&wifi_queue) < MIDI_QUEUE_SIZE / 2) {
+		in_size = sizeof(in);
+		res = recvfrom(sockin, recbuf, WIFI_RX_SIZE, 0, (struct sockaddr*)&in, &in_size);
+		if(res <= 0)
+			break;
+		dsmi_wifi_learn_peer();
+		dsmi_wifi_recv(res);
+	}
+}
+
+// Force receiving over Wifi
+extern int dsmi_read_wifi(u8* message, u8* data1, u8* data2)
+{
+	dsmi_msg msg;
+	
+	dsmi_wifi_poll();
+	
+	if(!midi_queue_count(&wifi_queue))
+		dsmi_wifi_drain();
+	
+	if(!midi_queue_pop(&wifi_queue, &msg))
+		return 0;
+	
+	*message = msg.message;
+	*data1 = msg.data1;
+	*data2 = msg.data2;
+	
+	return 1;
+}
+
+extern void dsmi_set_peer(unsigned long ip)
+{
+	if(ip == 0) {
+		wifi_peer = WIFI_PEER_BROADCAST;
+		addr_out_to.sin_addr.s_addr = wifi_bcast_ip;
+	} else {
+		wifi_peer = WIFI_PEER_FIXED;
+		addr_out_to.sin_addr.s_addr = ip;
+	}
+}
+
+extern void dsmi_set_wifi_receive_mode(int mode)
+{
+	wifi_rx_mode = mode;
+	midi_parser_init(&wifi_parser);
+}
+
+const dsmi_transport dsmi_wifi_transport = {
+	DSMI_WIFI,
+	&wifi_enabled,
+	&wifi_parser,
+	dsmi_write_wifi,
+	dsmi_write_now_wifi,
+	dsmi_write_batch_wifi,
+	dsmi_write_now_batch_wifi,
+	dsmi_sync_write_wifi,
+	dsmi_read_wifi,
+	dsmi_sysex_write_wifi,
+	dsmi_flush_wifi,
+	dsmi_wifi_frame
+};
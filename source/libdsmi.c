@@ -1,45 +1,228 @@
 #include <nds.h>
+#include <string.h>
 
+#ifndef DSMI_NO_WIFI
 #include <dswifi9.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
-
+#endif
 
 #include "libdsmi.h"
+#ifndef DSMI_NO_DSERIAL
 #include "dserial.h"
-#include "uart.h"
 #include "firmware_bin.h"
-#include "osc_client.h"
-
-#define PC_PORT		9000
-#define DS_PORT		9001
-#define DS_SENDER_PORT	9002
+#endif
+#ifndef DSMI_NO_DSBRUT
+#include "uart.h"
+#endif
+#include "midi_parser.h"
+#include "dsmi_clock.h"
+#include "dsmi_stats.h"
+#include "dsmi_internals.h"
+
+#if defined(DSMI_NO_DSERIAL) && defined(DSMI_NO_DSBRUT) && defined(DSMI_NO_WIFI)
+#error "DSMI needs at least one transport"
+#endif
+
+#define SYSEX_PULL_SIZE		64	// bytes taken from a SysEx pull callback at once
+#define CONNECT_BOOT_POLLS	4	// dsmi_connect_poll calls the DSerial firmware gets to start
+
+// The transports built into the library, indexed by interface
+static const dsmi_transport* const transports[3] = {
+#ifndef DSMI_NO_DSERIAL
+	[DSMI_SERIAL] = &dsmi_dserial_transport,
+#endif
+#ifndef DSMI_NO_WIFI
+	[DSMI_WIFI] = &dsmi_wifi_transport,
+#endif
+#ifndef DSMI_NO_DSBRUT
+	[DSMI_BRUT] = &dsmi_dsbrut_transport,
+#endif
+};
+
+// With a single transport built in, the default interface can only be
+// that one and the calls go straight to its functions
+#if defined(DSMI_NO_DSBRUT) && defined(DSMI_NO_WIFI)
+#define DSMI_ONLY(op)	dsmi_##op##_dserial
+#elif defined(DSMI_NO_DSERIAL) && defined(DSMI_NO_WIFI)
+#define DSMI_ONLY(op)	dsmi_##op##_dsbrut
+#elif defined(DSMI_NO_DSERIAL) && defined(DSMI_NO_DSBRUT)
+#define DSMI_ONLY(op)	dsmi_##op##_wifi
+#endif
+
+#ifdef DSMI_ONLY
+#define DSMI_CALL(op)	DSMI_ONLY(op)
+#else
+#define DSMI_CALL(op)	transport->op
+#endif
 
-int sock, sockin;
-struct sockaddr_in addr_out_from, addr_out_to, addr_in;
+int default_interface = -1;
 
-OSCbuf osc_buffer;
+int dsmi_batching = 0;
 
-char recbuf[3];
+// Running status state of each serial output, indexed by interface (and
+// DSMI_SERIAL_UART1 for the second DSerial port)
+typedef struct {
+	int enabled;
+	u8 status;		// status byte the receiver currently assumes, 0 if none
+	u32 refresh;	// clock ticks between full status bytes, 0 to never refresh
+	u32 sent_at;	// when status was last sent in full
+} running_status;
 
-int in_size;
-struct sockaddr_in in;
+static running_status running[4];
 
-int default_interface = -1;
+// SysEx streamed from a pull callback by dsmi_sysex_poll
+static int (*sysex_pull)(u8* buf, int max, void* user) = NULL;
+static void* sysex_pull_user;
+static int sysex_interface;
+static u8 sysex_buf[SYSEX_PULL_SIZE];
+static int sysex_pos = 0;
+static int sysex_size = 0;
 
-int wifi_enabled = 0;
-int dserial_enabled = 0;
-int dsbrut_enabled = 0;
+// Received SysEx of all interfaces goes here, see dsmi_set_sysex_receiver
+static midi_sysex sysex_rx;
 
-extern void wifiValue32Handler(u32 value, void* data);
-extern void arm9_synctoarm7();
+// Received messages are handed to the read callback from the receive
+// interrupts or from dsmi_dispatch, see dsmi_set_read_callback
+void (*dsmi_read_callback)(u8 message, u8 data1, u8 data2) = NULL;
+int dsmi_read_callback_mode = DSMI_CALLBACK_DEFERRED;
 
 // ------------ PRIVATE ------------ //
 
-void dsmi_uart_recv(char * data, unsigned int size)
+#ifndef DSMI_ONLY
+// Stands in for the default transport until one is connected
+static void dsmi_none_write(u8 message, u8 data1, u8 data2)
+{
+}
+
+static void dsmi_none_write_batch(const dsmi_msg* msgs, int n)
+{
+}
+
+static void dsmi_none_sync_write(u8 message)
+{
+}
+
+static int dsmi_none_read(u8* message, u8* data1, u8* data2)
+{
+	return 0;
+}
+
+static int dsmi_none_sysex_write(const u8* data, int size)
+{
+	return 0;
+}
+
+static void dsmi_none_flush(void)
+{
+}
+
+static int dsmi_none_enabled = 0;
+
+static const dsmi_transport dsmi_none_transport = {
+	-1,
+	&dsmi_none_enabled,
+	NULL,
+	dsmi_none_write,
+	dsmi_none_write,
+	dsmi_none_write_batch,
+	dsmi_none_write_batch,
+	dsmi_none_sync_write,
+	dsmi_none_read,
+	dsmi_none_sysex_write,
+	dsmi_none_flush,
+	NULL
+};
+
+static const dsmi_transport* transport = &dsmi_none_transport;
+#endif
+
+// Returns the transport of interface, NULL if it isn't built in
+const dsmi_transport* dsmi_transport_of(int interface)
+{
+	if(interface < DSMI_SERIAL || interface > DSMI_BRUT)
+		return NULL;
+	return transports[interface];
+}
+
+void dsmi_select_interface(int interface)
+{
+	default_interface = interface;
+#ifndef DSMI_ONLY
+	transport = transports[interface];
+#endif
+}
+
+// Puts a message into buf and returns its size on the wire. Serial MIDI
+// only gets the data bytes the status byte asks for.
+int dsmi_pack_serial(u8* buf, u8 message, u8 data1, u8 data2)
+{
+	buf[0] = message;
+	buf[1] = data1;
+	buf[2] = data2;
+
+	return 1 + midi_msg_length(message);
+}
+
+// Copies whole serial MIDI messages from src to dest, leaving out the
+// status bytes the receiver already has if running status is enabled.
+// This has to happen in wire order, so it is only called right before
+// the bytes are queued for sending. Returns the number of bytes in dest.
+int dsmi_running_status(int interface, u8* dest, const u8* src, int size)
+{
+	running_status* rs = &running[interface];
+	u32 now = rs->enabled && rs->refresh ? dsmi_clock_ticks() : 0;
+	int i = 0;
+	int n = 0;
+
+	while(i < size) {
+		u8 status = src[i];
+		int length = midi_msg_length(status);
+
+		if(i + 1 + length > size)
+			length = size - i - 1;
+
+		if(rs->enabled && status >= 0x80 && status < 0xF0) {
+			if(status != rs->status || (rs->refresh != 0 && now - rs->sent_at >= rs->refresh)) {
+				rs->status = status;
+				rs->sent_at = now;
+				dest[n++] = status;
+			}
+		} else {
+			// system common messages cancel running status
+			if(status >= 0xF0 && status < 0xF8)
+				rs->status = 0;
+			dest[n++] = status;
+		}
+
+		memcpy(dest + n, src + i + 1, length);
+		n += length;
+		i += 1 + length;
+	}
+
+	return n;
+}
+
+void dsmi_running_status_reset(int interface)
 {
-	// TODO
+	running[interface].status = 0;
+}
+
+// Sends a message right away, bypassing batching
+void dsmi_write_now(int interface, u8 message, u8 data1, u8 data2)
+{
+	const dsmi_transport* t = dsmi_transport_of(interface);
+
+	if(t != NULL)
+		t->write_now(message, data1, data2);
+}
+
+// Realtime messages take the realtime lane of the serial interfaces, so
+// they don't wait for queued output. On wifi they are never batched.
+void dsmi_sync_write_now(int interface, u8 message)
+{
+	const dsmi_transport* t = dsmi_transport_of(interface);
+
+	if(t != NULL)
+		t->sync_write(message);
 }
 
 // ------------ SETUP ------------ //
@@ -53,333 +236,398 @@ void dsmi_uart_recv(char * data, unsigned int size)
 extern int dsmi_connect(void)
 {
 
+#ifndef DSMI_NO_DSERIAL
 	if(dsmi_connect_dserial()) {
 		return 1;
 	}
+#endif
 
+#ifndef DSMI_NO_DSBRUT
 	if(dsmi_connect_dsbrut()) {
 		return 1;
 	}
+#endif
 
+#ifndef DSMI_NO_WIFI
 	if(dsmi_connect_wifi()) {
 		return 1;
 	}
+#endif
 
 	return 0;
 }
 
 
-// Using these you can force a wifi connection even if a DSerial is
-// inserted or set up both connections for forwarding.
-extern int dsmi_connect_dserial(void)
+// ------------ ASYNCHRONOUS SETUP ------------ //
+
+static int connect_state = DSMI_CONNECT_IDLE;
+#ifndef DSMI_NO_DSERIAL
+static int connect_polls;				// polls spent waiting for the firmware
+#endif
+static unsigned int connect_done = 0;	// DSerial firmware bytes checked
+static unsigned int connect_total = 0;
+
+extern void dsmi_connect_begin(void)
 {
-	if(!dseInit())
-		return 0;
-	
-	//int version = dseVersion();
-	//if(version < 2) {
-	//	printf("Version: DSerial1/2\n");
-	//} else if(version == 2) {
-	//	printf("Version: DSerial Edge\n");
-	//}
+	connect_state = DSMI_CONNECT_DSERIAL;
+	connect_done = connect_total = 0;
+}
+
+extern void dsmi_connect_get_progress(unsigned int* done, unsigned int* total)
+{
+	*done = connect_done;
+	*total = connect_total;
+}
+
+// The state after the serial interfaces, wifi if it is built in
+static int dsmi_connect_next_wifi(void)
+{
+#ifdef DSMI_NO_WIFI
+	return DSMI_CONNECT_FAILED;
+#else
+	Wifi_EnableWifi();
+	if(dsmi_wifi_start())
+		return DSMI_CONNECT_WIFI_INIT;
+
+	Wifi_DisableWifi();
+	return DSMI_CONNECT_FAILED;
+#endif
+}
+
+#ifndef DSMI_NO_DSERIAL
+// Starts the DSerial firmware, it is checked for with the next polls
+static int dsmi_connect_boot(void)
+{
+	dseBoot();
+	connect_polls = 0;
+	return DSMI_CONNECT_DSERIAL_BOOT;
+}
+#endif
+
+// Does one step of dsmi_connect. None of them waits for the hardware,
+// the firmware is checked and rewritten a flash page per step. The steps
+// of transports that aren't built in fall through to the next one.
+extern int dsmi_connect_poll(void)
+{
+#ifndef DSMI_NO_WIFI
+	int status;
+#endif
+#ifndef DSMI_NO_DSBRUT
+	int ready;
+#endif
 	
-	// Upload firmware if necessary
-	if (!dseMatchFirmware((char*)firmware_bin, firmware_bin_end - firmware_bin))
-	{
-		dseUploadFirmware((char *) firmware_bin, firmware_bin_end - firmware_bin);
-	}
+	switch(connect_state) {
+	case DSMI_CONNECT_DSERIAL:
+#ifdef DSMI_NO_DSERIAL
+		connect_state = DSMI_CONNECT_DSBRUT;
+#else
+		if(!dseInit()) {
+			connect_state = DSMI_CONNECT_DSBRUT;
+			break;
+		}
+		
+		// the stamp only takes one read, a full check is done page by page
+		connect_total = firmware_bin_end - firmware_bin;
+		if(dseMatchFirmwareStamp((char*)firmware_bin, connect_total)) {
+			connect_done = connect_total;
+			connect_state = dsmi_connect_boot();
+		} else {
+			dseUpdateBegin((char*)firmware_bin, connect_total);
+			connect_state = DSMI_CONNECT_DSERIAL_UPLOAD;
+		}
+#endif
+		break;
 	
-	dseBoot();
+#ifndef DSMI_NO_DSERIAL
+	case DSMI_CONNECT_DSERIAL_UPLOAD:
+		connect_done = dseUpdateStep();
+		if(connect_done == connect_total)
+			connect_state = dsmi_connect_boot();
+		break;
 	
-	swiDelay(9999); // Wait for the FW to boot
-	if (dseStatus() != FIRMWARE)
-		return 0;
+	case DSMI_CONNECT_DSERIAL_BOOT:
+		if(dseStatus() == FIRMWARE)
+			connect_state = dsmi_dserial_open() ? DSMI_CONNECT_DONE : DSMI_CONNECT_DSBRUT;
+		else if(++connect_polls >= CONNECT_BOOT_POLLS)
+			connect_state = DSMI_CONNECT_DSBRUT;
+		break;
+#endif
 	
-	dseSetModes(ENABLE_CMOS);
+	case DSMI_CONNECT_DSBRUT:
+#ifndef DSMI_NO_DSBRUT
+		if(uart_init_begin()) {
+			connect_state = DSMI_CONNECT_DSBRUT_WAIT;
+			break;
+		}
+#endif
+		connect_state = dsmi_connect_next_wifi();
+		break;
 	
-	dseUartSetBaudrate(UART0, 31250); // MIDI baud rate
+#ifndef DSMI_NO_DSBRUT
+	case DSMI_CONNECT_DSBRUT_WAIT:
+		ready = uart_init_poll();
+		if(ready > 0) {
+			dsmi_dsbrut_open();
+			connect_state = DSMI_CONNECT_DONE;
+		} else if(ready < 0) {
+			connect_state = dsmi_connect_next_wifi();
+		}
+		break;
+#endif
 	
-	dseUartSetReceiveHandler(UART0, dsmi_uart_recv);
+#ifndef DSMI_NO_WIFI
+	case DSMI_CONNECT_WIFI_INIT:
+		if(Wifi_CheckInit()) {
+			Wifi_AutoConnect(); // request connect
+			connect_state = DSMI_CONNECT_WIFI_ASSOC;
+		}
+		break;
 	
-	default_interface = DSMI_SERIAL;
-
-	dserial_enabled = 1;
+	case DSMI_CONNECT_WIFI_ASSOC:
+		status = Wifi_AssocStatus();
+		if(status == ASSOCSTATUS_ASSOCIATED) {
+			dsmi_wifi_open();
+			connect_state = DSMI_CONNECT_DONE;
+		} else if(status == ASSOCSTATUS_CANNOTCONNECT) {
+			Wifi_DisableWifi();
+			connect_state = DSMI_CONNECT_FAILED;
+		}
+		break;
+#endif
+	}
 	
-	return 1;
+	return connect_state;
 }
 
+// ------------ WRITE ------------ //
 
-extern int dsmi_connect_dsbrut(void)
+// Send a MIDI message over the default interface, see MIDI spec for more details
+extern void dsmi_write(u8 message,u8 data1, u8 data2)
 {
-	if(!uart_init())
-		return 0;
-	
-	uart_set_bps(31250); // MIDI baud rate
-	
-	default_interface = DSMI_BRUT;
-
-	dsbrut_enabled = 1;
-	
-	return 1;
+	DSMI_CALL(write)(message, data1, data2);
 }
 
-
-
-void dsmi_timer_50ms(void) {
-    Wifi_Timer(50);
-
-    if(wifi_enabled == 1 && default_interface == DSMI_WIFI)
-    {
-        // Send a keepalive beacon every 3 seconds
-        static u8 counter = 0;
-        counter++;
-        if(counter == 60)
-        {
-            counter = 0;
-            dsmi_write(0, 0, 0);
-        }
-    }
+// Sends coalesced output, a pending keepalive and stalled DSerial
+// output, call once per frame
+extern void dsmi_flush(void)
+{
+	const dsmi_transport* t;
+	int i;
+
+	dsmi_sysex_poll();
+	for(i = 0; i < 3; i++) {
+		t = transports[i];
+		if(t != NULL && *t->enabled && t->frame != NULL)
+			t->frame();
+	}
 }
 
-// Modified version of dswifi's init function that uses a custom timer handler
-// In addition to calling Wifi_Timer, new new handler also sends the DSMI keepalive
-// beacon.
-bool dsmi_wifi_init(void) {
-    fifoSetValue32Handler(FIFO_DSWIFI,  wifiValue32Handler, 0);
-
-    u32 wifi_pass = Wifi_Init(WIFIINIT_OPTION_USELED);
 
-    if(!wifi_pass) return false;
-
-    irqSet(IRQ_TIMER3, dsmi_timer_50ms); // setup timer IRQ
-    irqEnable(IRQ_TIMER3);
+// Starts collecting messages instead of sending each one on its own
+extern void dsmi_write_begin(void)
+{
+	dsmi_batching = 1;
+}
 
-    Wifi_SetSyncHandler(arm9_synctoarm7); // tell wifi lib to use our handler to notify arm7
+// Sends all messages collected since dsmi_write_begin
+extern void dsmi_write_commit(void)
+{
+	int i;
 
-    // set timer3
-    TIMER3_DATA = -6553; // 6553.1 * 256 cycles = ~50ms;
-    TIMER3_CR = 0x00C2; // enable, irq, 1/256 clock
+	dsmi_batching = 0;
 
-    fifoSendAddress(FIFO_DSWIFI, (void *)wifi_pass);
+	for(i = 0; i < 3; i++) {
+		if(transports[i] != NULL)
+			transports[i]->flush();
+	}
+}
 
-    while(Wifi_CheckInit()==0) {
-        swiWaitForVBlank();
-    }
+// Enables or disables running status on a serial interface
+extern int dsmi_set_running_status(int interface, int enable, int refresh_ms)
+{
+	running_status* rs;
 
-    int wifiStatus = ASSOCSTATUS_DISCONNECTED;
+	if(interface != DSMI_SERIAL && interface != DSMI_BRUT)
+		return 0;
 
-    Wifi_AutoConnect(); // request connect
+	rs = &running[interface];
+	rs->enabled = 0;
+	rs->status = 0;
+	if(interface == DSMI_SERIAL)
+		running[DSMI_SERIAL_UART1] = *rs;
 
-    while(wifiStatus != ASSOCSTATUS_ASSOCIATED) {
-        wifiStatus = Wifi_AssocStatus(); // check status
+	if(!enable)
+		return 1;
 
-        if(wifiStatus == ASSOCSTATUS_CANNOTCONNECT) return false;
-        swiWaitForVBlank();
+	// refreshing needs a time base, without one we keep sending full messages
+	if(refresh_ms > 0 && !dsmi_clock_init())
+		return 0;
 
-    }
+	rs->refresh = DSMI_CLOCK_MS(refresh_ms);
+	rs->enabled = 1;
+	if(interface == DSMI_SERIAL)
+		running[DSMI_SERIAL_UART1] = *rs;
 
-    return true;    
+	return 1;
 }
 
-extern int dsmi_connect_wifi(void)
+// Sends n messages over the default interface as one batch
+extern void dsmi_write_batch(const dsmi_msg* msgs, int n)
 {
-    Wifi_EnableWifi();
-
-	if(!dsmi_wifi_init()) {
-        Wifi_DisableWifi();
-		return 0;
-	}
-	
-	int i = Wifi_AssocStatus();
-	if(i == ASSOCSTATUS_CANNOTCONNECT) {
-		return 0;
-	} else if(i == ASSOCSTATUS_ASSOCIATED) {
-		sock = socket(AF_INET, SOCK_DGRAM, 0); // setup socket for DGRAM (UDP), returns with a socket handle
-		sockin = socket(AF_INET, SOCK_DGRAM, 0);
-		
-		// Source
-		addr_out_from.sin_family = AF_INET;
-		addr_out_from.sin_port = htons(DS_SENDER_PORT);
-		addr_out_from.sin_addr.s_addr = INADDR_ANY;
-		
-		// Destination
-		addr_out_to.sin_family = AF_INET;
-		addr_out_to.sin_port = htons(PC_PORT);
-		
-		struct in_addr gateway, snmask, dns1, dns2;
-		Wifi_GetIPInfo(&gateway, &snmask, &dns1, &dns2);
-
-		unsigned long my_ip = Wifi_GetIP(); // Set IP to broadcast IP
-		unsigned long bcast_ip = my_ip | ~snmask.s_addr;
-		
-		addr_out_to.sin_addr.s_addr = bcast_ip;
-		
-		// Receiver
-		addr_in.sin_family = AF_INET;
-		addr_in.sin_port = htons(DS_PORT);
-		addr_in.sin_addr.s_addr = INADDR_ANY;
-		
-		bind(sock, (struct sockaddr*)&addr_out_from, sizeof(addr_out_from));
-		bind(sockin, (struct sockaddr*)&addr_in, sizeof(addr_in));
-		
-		u8 val = 1;
-		ioctl(sockin, FIONBIO, (char*)&val);  // Enable non-blocking I/O
-		
-		default_interface = DSMI_WIFI;
-		wifi_enabled = 1;
-		
-		return 1;
-	} else {
-		return 0;
-	}
+	DSMI_CALL(write_batch)(msgs, n);
 }
 
 
 
-// ------------ WRITE ------------ //
-
-// Send a MIDI message over the default interface, see MIDI spec for more details
-extern void dsmi_write(u8 message,u8 data1, u8 data2)
+// Send a MIDI SYNC System message over the default interface, see MIDI spec for more details
+extern void dsmi_sync_write(u8 message)
 {
-	if(default_interface == DSMI_WIFI)
-		dsmi_write_wifi(message, data1, data2);
-	else if(default_interface == DSMI_BRUT)
-		dsmi_write_dsbrut(message, data1, data2);
-	else if(default_interface == DSMI_SERIAL)
-		dsmi_write_dserial(message, data1, data2);
+	DSMI_CALL(sync_write)(message);
 }
 
+// ------------ SYSEX ------------ //
 
-// Force a MIDI message to be sent over DSerial
-extern void dsmi_write_dserial(u8 message,u8 data1, u8 data2)
+// Queues as much of a SysEx as the interface takes right now and returns
+// the number of bytes taken. The transport queues cut it into frames, the
+// realtime lanes still go ahead of it.
+static int dsmi_sysex_send(int interface, const u8* data, int size)
 {
-	u8 sendbuf[3] = {message, data1, data2};
-	dseUartSendBuffer(UART0, (char*)sendbuf, 3, true);
-}
+	const dsmi_transport* t = dsmi_transport_of(interface);
 
-// Force a MIDI message to be sent over DSBrut
-extern void dsmi_write_dsbrut(u8 message,u8 data1, u8 data2)
-{
-	uint8_t sendbuf[3] = {message, data1, data2};
-	uart_write(sendbuf, 3);
+	return t != NULL ? t->sysex_write(data, size) : 0;
 }
 
-
-// Force a MIDI message to be sent over Wifi
-extern void dsmi_write_wifi(u8 message,u8 data1, u8 data2)
+extern int dsmi_sysex_write(const u8* data, int size)
 {
-	char sendbuf[3] = {message, data1, data2};
-	sendto(sock, &sendbuf, 3, 0, (struct sockaddr*)&addr_out_to, sizeof(addr_out_to));
+	return DSMI_CALL(sysex_write)(data, size);
 }
 
+// Streams a SysEx from the callback over the default interface
+extern int dsmi_sysex_stream(int (*pull)(u8* buf, int max, void* user), void* user)
+{
+	if(dsmi_transport_of(default_interface) == NULL || pull == NULL)
+		return 0;
 
+	sysex_interface = default_interface;
+	sysex_pull_user = user;
+	sysex_pos = sysex_size = 0;
+	sysex_pull = pull;
 
-// Send a MIDI SYNC System message over the default interface, see MIDI spec for more details
-extern void dsmi_sync_write(u8 message)
-{
-	if(default_interface == DSMI_WIFI)
-		dsmi_sync_write_wifi(message);
-	else if(default_interface == DSMI_BRUT)
-		dsmi_sync_write_dsbrut(message);
-	else if(default_interface == DSMI_SERIAL)
-		dsmi_sync_write_dserial(message);
+	dsmi_sysex_poll();
+	return 1;
 }
 
-
-// Force a MIDI SYNC System message to be sent over DSerial
-extern void dsmi_sync_write_dserial(u8 message)
+// Sends what fits of the streamed SysEx, returns 1 until it is done
+extern int dsmi_sysex_poll(void)
 {
-	char sendbuf[1] = {message};
-	dseUartSendBuffer(UART0,(char*)&sendbuf, 1, true);
+	int n;
+
+	while(sysex_pull != NULL) {
+		if(sysex_pos == sysex_size) {
+			sysex_pos = 0;
+			sysex_size = sysex_pull(sysex_buf, SYSEX_PULL_SIZE, sysex_pull_user);
+			if(sysex_size <= 0) {
+				sysex_size = 0;
+				sysex_pull = NULL;
+				break;
+			}
+		}
+
+		n = dsmi_sysex_send(sysex_interface, sysex_buf + sysex_pos, sysex_size - sysex_pos);
+		sysex_pos += n;
+
+		// the transport is full, the rest goes on the next poll
+		if(sysex_pos < sysex_size)
+			break;
+	}
+
+	return sysex_pull != NULL;
 }
 
-// Force a MIDI SYNC System SYNC System message to be sent over DSBrut
-extern void dsmi_sync_write_dsbrut(u8 message)
+extern void dsmi_sysex_cancel(void)
 {
-	uint8_t sendbuf[1] = {message};
-	uart_write(sendbuf, 1);
+	sysex_pull = NULL;
+	sysex_pos = sysex_size = 0;
 }
 
-
-// Force a MIDI message to be sent over Wifi
-extern void dsmi_sync_write_wifi(u8 message)
+// Received SysEx is collected into buffer and handed to handler in pieces
+extern void dsmi_set_sysex_receiver(u8* buffer, int size, void (*handler)(u8* data, int size, int flags))
 {
-	char sendbuf[1] = {message};
-	sendto(sock, &sendbuf, 1, 0, (struct sockaddr*)&addr_out_to, sizeof(addr_out_to));
-}
+	midi_sysex* sysex = NULL;
+	int oldIME = enterCriticalSection();
+	int i;
+
+	if(buffer != NULL && size > 0 && handler != NULL) {
+		sysex_rx.buffer = buffer;
+		sysex_rx.size = size;
+		sysex_rx.count = 0;
+		sysex_rx.flags = 0;
+		sysex_rx.handler = handler;
+		sysex = &sysex_rx;
+	}
 
+	for(i = 0; i < 3; i++) {
+		if(transports[i] != NULL)
+			transports[i]->parser->sysex = sysex;
+	}
 
-// ------------ OSC WRITE ------------ //
+	leaveCriticalSection(oldIME);
+}
 
-// Resets the OSC buffer and sets the destination open sound control address, returns 1 if ok, 0 if address string not valid
-extern int dsmi_osc_new( char* addr){
+// ------------ READ ------------ //
 
-  osc_init( &osc_buffer);
-  return osc_writeaddr( &osc_buffer, addr);
-  
+extern void dsmi_set_read_callback(void (*onData_)(u8 message, u8 data1, u8 data2))
+{
+	dsmi_set_read_callback_mode(onData_, dsmi_read_callback_mode);
 }
 
-// Adds arguments to the OSC packet
-extern int dsmi_osc_addintarg( long arg){
-
-  return osc_addintarg( &osc_buffer, arg);
+extern void dsmi_set_read_callback_mode(void (*onData_)(u8 message, u8 data1, u8 data2), int mode)
+{
+	int oldIME = enterCriticalSection();
 
-}
-extern int dsmi_osc_addstringarg( char* arg){
+	dsmi_read_callback = onData_;
+	dsmi_read_callback_mode = mode;
 
-  return osc_addstringarg( &osc_buffer, arg);
+	leaveCriticalSection(oldIME);
 }
 
-extern int dsmi_osc_addfloatarg( float arg){
+// Hands all messages received so far to the read callback
+extern int dsmi_dispatch(void)
+{
+	const dsmi_transport* t;
+	u8 message, data1, data2;
+	int count = 0;
+	int i;
 
-  return osc_addfloatarg( &osc_buffer, arg);
+	if(dsmi_read_callback == NULL)
+		return 0;
 
-}
+	// in DSMI_CALLBACK_IRQ mode only wifi is left to do here
+	for(i = 0; i < 3; i++) {
+		t = transports[i];
+		if(t == NULL || !*t->enabled)
+			continue;
 
-// Sends the OSC packet
-extern int dsmi_osc_send(void){
+		// the DSBrut input is read in its spi irq then
+		if(i == DSMI_BRUT && dsmi_read_callback_mode == DSMI_CALLBACK_IRQ)
+			continue;
 
-  char* msg = osc_getPacket( &osc_buffer);
-  int size = osc_getPacketSize( &osc_buffer);
-  
-  return sendto(sock, msg, size, 0, (struct sockaddr*)&addr_out_to, sizeof(addr_out_to));
+		while(t->read(&message, &data1, &data2)) {
+			dsmi_read_callback(message, data1, data2);
+			count++;
+		}
+	}
 
+	return count;
 }
 
-// ------------ READ ------------ //
-
 // Checks if a new message arrived at the default interface and returns it by
 // filling the given pointers
 //
 // Returns 1, if a message was received, 0 if not
 extern int dsmi_read(u8* message, u8* data1, u8* data2)
 {
-	if(default_interface == DSMI_WIFI)
-		return dsmi_read_wifi(message, data1, data2);
-	//else if(default_interface == DSMI_SERIAL)
-	//	dsmi_write_serial(message, data1, data2);
-	else
-		return 0;
-}
-
-
-// Force receiving over DSerial / Wifi
-// extern int dsmi_read_dserial(u8* message, u8* data1, u8* data2); // TODO
-
-
-// Force receiving over DSerial / Wifi
-extern int dsmi_read_wifi(u8* message, u8* data1, u8* data2)
-{
-	int res = recvfrom(sockin, recbuf, 3, 0, (struct sockaddr*)&in, &in_size);
-	
-	if(res <= 0)
-		return 0;
-	
-	*message = recbuf[0];
-	*data1 = recbuf[1];
-	*data2 = recbuf[2];
-	
-	return 1;
+	return DSMI_CALL(read)(message, data1, data2);
 }
 
 
@@ -0,0 +1,157 @@
+//    MIDI byte stream parsing and message queueing shared by the
+//    DSMI interfaces.
+
+#include <nds.h>
+
+#include "midi_parser.h"
+
+// keeps the compiler from moving buffer accesses across index updates
+#define barrier() __asm__ __volatile__ ("" ::: "memory")
+
+int midi_msg_length(u8 status)
+{
+	switch(status & 0xF0) {
+		case 0xC0: // program change
+		case 0xD0: // channel pressure
+			return 1;
+		case 0xF0:
+			if(status == 0xF1 || status == 0xF3) // time code, song select
+				return 1;
+			if(status == 0xF2) // song position
+				return 2;
+			return 0;
+		default:
+			return 2;
+	}
+}
+
+static void midi_sysex_flush(midi_sysex* sysex, int flags)
+{
+	sysex->handler(sysex->buffer, sysex->count, sysex->flags | flags);
+	sysex->count = 0;
+	sysex->flags = 0;
+}
+
+static void midi_sysex_put(midi_sysex* sysex, u8 byte)
+{
+	// a full buffer is only handed over once more bytes follow, so the
+	// last piece always comes with DSMI_SYSEX_END
+	if(sysex->count == sysex->size)
+		midi_sysex_flush(sysex, 0);
+	sysex->buffer[sysex->count++] = byte;
+}
+
+void midi_parser_init(midi_parser* parser)
+{
+	parser->status = 0;
+	parser->length = 0;
+	parser->count = 0;
+}
+
+int midi_parse(midi_parser* parser, u8 byte, dsmi_msg* msg)
+{
+	if(byte >= 0xF8) {
+		// realtime messages may appear anywhere and don't touch running status
+		msg->message = byte;
+		msg->data1 = 0;
+		msg->data2 = 0;
+		return 1;
+	}
+
+	if(byte & 0x80) {
+		if(parser->status == 0xF0 && parser->sysex != NULL) {
+			if(byte == 0xF7) {
+				midi_sysex_put(parser->sysex, byte);
+				midi_sysex_flush(parser->sysex, DSMI_SYSEX_END);
+			} else {
+				// any other status byte ends a SysEx too
+				midi_sysex_flush(parser->sysex, DSMI_SYSEX_END | DSMI_SYSEX_ABORTED);
+			}
+		}
+		if(byte == 0xF0 && parser->sysex != NULL) {
+			parser->sysex->count = 0;
+			parser->sysex->flags = DSMI_SYSEX_START;
+			midi_sysex_put(parser->sysex, byte);
+		}
+
+		parser->status = byte;
+		parser->length = midi_msg_length(byte);
+		parser->count = 0;
+
+		if(byte == 0xF7 || (byte > 0xF0 && parser->length == 0)) {
+			// end of sysex, tune request and undefined system common
+			// messages cancel running status
+			parser->status = 0;
+			if(byte == 0xF6) {
+				msg->message = byte;
+				msg->data1 = 0;
+				msg->data2 = 0;
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	if(parser->status == 0xF0) {
+		if(parser->sysex != NULL)
+			midi_sysex_put(parser->sysex, byte);
+		return 0;
+	}
+
+	// data byte without status
+	if(parser->status == 0)
+		return 0;
+
+	parser->data[parser->count++] = byte;
+	if(parser->count < parser->length)
+		return 0;
+
+	msg->message = parser->status;
+	msg->data1 = parser->data[0];
+	msg->data2 = parser->length == 2 ? parser->data[1] : 0;
+
+	parser->count = 0;
+	if(parser->status >= 0xF0)
+		parser->status = 0; // no running status for system common messages
+
+	return 1;
+}
+
+void midi_queue_init(midi_queue* queue)
+{
+	queue->head = 0;
+	queue->tail = 0;
+}
+
+int midi_queue_push(midi_queue* queue, const dsmi_msg* msg)
+{
+	u16 tail = queue->tail;
+
+	if((u16)(tail - queue->head) == MIDI_QUEUE_SIZE)
+		return 0;
+
+	queue->msgs[tail & MIDI_QUEUE_MASK] = *msg;
+	barrier();
+	queue->tail = tail + 1;
+
+	return 1;
+}
+
+int midi_queue_pop(midi_queue* queue, dsmi_msg* msg)
+{
+	u16 head = queue->head;
+
+	if(head == queue->tail)
+		return 0;
+
+	*msg = queue->msgs[head & MIDI_QUEUE_MASK];
+	barrier();
+	queue->head = head + 1;
+
+	return 1;
+}
+
+int midi_queue_count(midi_queue* queue)
+{
+	return (u16)(queue->tail - queue->head);
+}
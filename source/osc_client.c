@@ -9,6 +9,56 @@
 
 #include "osc_client.h"
 
+// copies len bytes of src ( including the terminator) and pads with zeros
+// to a multiple of 4, returns the padded length
+static int osc_copyPadded( char* dest, const char* src, int len){
+
+  int padded = (len + 3) & ~3;
+
+  memcpy( dest, src, len);
+  memset( dest + len, 0, padded - len);
+  return padded;
+
+}
+
+// OSC arguments are big endian
+static void osc_writeInt32( char* dest, uint32_t arg){
+
+  arg = htonl( arg);
+  memcpy( dest, &arg, 4);
+
+}
+
+// size of the type string ( ',' + tags + at least one '\0') padded to 4
+#define OSC_TYPESTRING_SIZE(numargs) (((numargs) + 5) & ~3)
+
+// The buffer always holds a complete packet: the type string only has the
+// room its tags need, and grows by 4 bytes every 4 tags with the arguments
+// written so far moving along ( never for messages of up to 2 arguments).
+// Adds a tag for an argument of argsize bytes, which goes to buf->pos.
+static int osc_addtag( OSCbuf* buf, char tag, int argsize){
+
+  int size, grow, args;
+  if( buf->status != OSC_ADDRESS) return 0;
+  if( buf->numargs >= OSC_MAX_ARGS - 2) return 0;
+
+  size = OSC_TYPESTRING_SIZE( buf->numargs);
+  grow = OSC_TYPESTRING_SIZE( buf->numargs + 1) - size;
+  if( buf->pos + grow + argsize > OSC_MAX_SIZE - 1) return 0;
+
+  if( grow > 0){
+    args = buf->posTypeString + size;
+    memmove( &buf->buffer[args + grow], &buf->buffer[args], buf->pos - args);
+    memset( &buf->buffer[args], 0, grow);
+    buf->pos += grow;
+  }
+
+  buf->numargs++;
+  buf->buffer[ buf->posTypeString + buf->numargs] = tag;
+  return 1;
+
+}
+
 void osc_init( OSCbuf* buf){
 	
   buf->pos = 0;
@@ -19,105 +69,181 @@ void osc_init( OSCbuf* buf){
 }
 int osc_writeaddr( OSCbuf* buf, char* addr){
   
+  int len;
   if (buf->status != OSC_EMPTY) return 0;
   if ( addr[0] != '/') return 0;
-  if ( strlen( addr ) >= OSC_MAX_SIZE) return 0;
+  len = strlen( addr) + 1;
+  if ( ((len + 3) & ~3) + OSC_TYPESTRING_SIZE( 0) > OSC_MAX_SIZE) return 0;
   
-  buf->posTypeString = osc_copyPaddedString( buf->buffer, addr);
-  buf->buffer[buf->posTypeString] = ',';
-  buf->pos = buf->posTypeString + OSC_MAX_ARGS;
+  buf->posTypeString = osc_copyPadded( buf->buffer, addr, len);
+  buf->pos = buf->posTypeString + osc_copyPadded( &buf->buffer[buf->posTypeString], ",", 2);
   buf->status = OSC_ADDRESS;
   
   return 1;
 
 }
 
-int osc_addintarg( OSCbuf* buf, long arg){
+int osc_addintarg( OSCbuf* buf, int32_t arg){
   
-  long convInt;
-  if( buf->status != OSC_ADDRESS) return 0;
-  if( buf->numargs >= OSC_MAX_ARGS - 1) return 0;
-  if( buf->pos + 4 > OSC_MAX_SIZE - 1) return 0;
+  if( !osc_addtag( buf, 'i', 4)) return 0;
   
-  buf->numargs++;
-  buf->buffer[ buf->posTypeString + buf->numargs] = 'i';
-  convInt = ntohl( arg );
-  memcpy( &buf->buffer[buf->pos], &convInt, 4);
+  osc_writeInt32( &buf->buffer[buf->pos], (uint32_t)arg);
   buf->pos += 4;
   return 1;
 
 }
 int osc_addfloatarg( OSCbuf* buf, float arg){
   
-  long* convFloat = (long*)&arg;
-  if( buf->status != OSC_ADDRESS) return 0;
-  if( buf->numargs >= OSC_MAX_ARGS - 1) return 0;
-  if( buf->pos + 4 > OSC_MAX_SIZE - 1) return 0;
+  uint32_t convFloat;
+  if( !osc_addtag( buf, 'f', 4)) return 0;
   
-  buf->numargs++;
-  buf->buffer[ buf->posTypeString + buf->numargs] = 'f';
-  *convFloat = ntohl( *convFloat );
-  memcpy( &buf->buffer[buf->pos], convFloat, 4);
+  memcpy( &convFloat, &arg, 4);
+  osc_writeInt32( &buf->buffer[buf->pos], convFloat);
   buf->pos += 4;
   return 1;  
 }
 int osc_addstringarg( OSCbuf* buf, char* arg){
 
-  if( buf->status != OSC_ADDRESS) return 0;
-  if( buf->numargs >= OSC_MAX_ARGS - 1) return 0;
-  if( buf->pos + osc_stringLength( arg) > OSC_MAX_SIZE - 1) return 0;
+  int len;
+  len = strlen( arg) + 1;
+  if( !osc_addtag( buf, 's', (len + 3) & ~3)) return 0;
   
-  buf->numargs++;
-  buf->buffer[ buf->posTypeString + buf->numargs] = 's';
-  buf->pos += osc_copyPaddedString( &buf->buffer[ buf->pos], arg); 
+  buf->pos += osc_copyPadded( &buf->buffer[ buf->pos], arg, len); 
   return 1;
   
 }
 
+// the packet is complete already, no more arguments are taken after this
 char* osc_getPacket( OSCbuf* buf ){
   
-  int i, pos, pad;
-  
-  pad = (4 - ((buf->numargs + 1) % 4)) % 4;
-  pos = buf->posTypeString + buf->numargs + 1 + pad;
-  for( i = buf->posTypeString + buf->numargs + 1; pad > 0; pad--)
-    buf->buffer[i++] = '\0';
-  for( i = buf->posTypeString + OSC_MAX_ARGS; i < buf->pos; i++)
-    buf->buffer[pos++] = buf->buffer[i];
-	
-  buf->pos = pos;
-  buf->status = OSC_PACKED;
+  if( buf->status == OSC_ADDRESS)
+    buf->status = OSC_PACKED;
   return buf->buffer;
   
 }
 
 int osc_getPacketSize( OSCbuf* buf ){
   
-  if( buf->status == OSC_PACKED)
-    return buf->pos;
-  else
-    return buf->pos - (OSC_MAX_ARGS - (buf->numargs + 1 + ((4 - (buf->numargs + 1)) % 4)));
+  if( buf->status == OSC_EMPTY)
+    return 0;
+  return buf->pos;
   
 }
 
-int osc_copyPaddedString(char* dest, char* src) {
-  
-  int len, pad, i;
+void osc_bundle_init( OSCbundle* bundle, unsigned int sec, unsigned int frac){
 
-  strcpy(dest, src);
-  len = strlen(src) + 1;
-  pad = (4 - len % 4) % 4;
-  
-  for( i = len; pad > 0; pad--)
-    dest[i++] = '\0';
+  unsigned int tag[2];
+
+  memcpy( bundle->buffer, "#bundle", 8);
+  tag[0] = htonl( sec);
+  tag[1] = htonl( frac);
+  memcpy( &bundle->buffer[8], tag, 8);
+  bundle->pos = 16;
+  bundle->numelems = 0;
+
+}
+
+int osc_bundle_fits( OSCbundle* bundle, int size){
+
+  return bundle->pos + 4 + size <= OSC_MAX_BUNDLE_SIZE;
 
-  return i;
+}
+
+// adds a message or bundle packet as an element, returns 0 if it doesn't fit
+int osc_bundle_add( OSCbundle* bundle, char* packet, int size){
+
+  unsigned int convSize;
+  if( size <= 0 || size % 4 != 0) return 0;
+  if( !osc_bundle_fits( bundle, size)) return 0;
+
+  convSize = htonl( size);
+  memcpy( &bundle->buffer[bundle->pos], &convSize, 4);
+  memcpy( &bundle->buffer[bundle->pos + 4], packet, size);
+  bundle->pos += 4 + size;
+  bundle->numelems++;
+  return 1;
+
+}
+
+char* osc_bundle_getPacket( OSCbundle* bundle){
+
+  return bundle->buffer;
+
+}
+
+int osc_bundle_getPacketSize( OSCbundle* bundle){
+
+  return bundle->pos;
+
+}
+
+int osc_template_init( OSCtemplate* tpl, char* addr, char* types){
+
+  int len, numargs, i, pos;
+
+  if( addr[0] != '/') return 0;
+  numargs = strlen( types);
+  if( numargs > OSC_MAX_ARGS - 2) return 0;
+  for( i = 0; i < numargs; i++)
+    if( types[i] != 'i' && types[i] != 'f') return 0;
+  len = strlen( addr) + 1;
+  if( ((len + 3) & ~3) + OSC_TYPESTRING_SIZE( numargs) + 4 * numargs > OSC_MAX_SIZE) return 0;
+
+  pos = osc_copyPadded( tpl->buffer, addr, len);
+  tpl->posTypeString = pos;
+  tpl->buffer[pos] = ',';
+  memcpy( &tpl->buffer[pos + 1], types, numargs);
+  memset( &tpl->buffer[pos + 1 + numargs], 0, OSC_TYPESTRING_SIZE( numargs) - numargs - 1);
+  pos += OSC_TYPESTRING_SIZE( numargs);
+
+  tpl->posArgs = pos;
+  memset( &tpl->buffer[pos], 0, 4 * numargs);
+  tpl->numargs = numargs;
+  tpl->size = pos + 4 * numargs;
+  return 1;
+
+}
+
+int osc_template_setint( OSCtemplate* tpl, int slot, int32_t arg){
+
+  if( slot < 0 || slot >= tpl->numargs) return 0;
+  if( tpl->buffer[tpl->posTypeString + 1 + slot] != 'i') return 0;
+
+  osc_writeInt32( &tpl->buffer[tpl->posArgs + 4 * slot], (uint32_t)arg);
+  return 1;
+
+}
+
+int osc_template_setfloat( OSCtemplate* tpl, int slot, float arg){
+
+  uint32_t convFloat;
+  if( slot < 0 || slot >= tpl->numargs) return 0;
+  if( tpl->buffer[tpl->posTypeString + 1 + slot] != 'f') return 0;
+
+  memcpy( &convFloat, &arg, 4);
+  osc_writeInt32( &tpl->buffer[tpl->posArgs + 4 * slot], convFloat);
+  return 1;
+
+}
+
+char* osc_template_getPacket( OSCtemplate* tpl){
+
+  return tpl->buffer;
+
+}
+
+int osc_template_getPacketSize( OSCtemplate* tpl){
+
+  return tpl->size;
+
+}
+
+int osc_copyPaddedString(char* dest, char* src) {
+  
+  return osc_copyPadded( dest, src, strlen( src) + 1);
 }
 
 int osc_stringLength( char* str) {
   
-  int len, pad;
-  len = strlen( str) + 1;
-  pad = (4 - len % 4) % 4;
-  return len + pad;
-}
\ No newline at end of file
+  return (strlen( str) + 4) & ~3;
+}
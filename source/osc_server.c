@@ -0,0 +1,378 @@
+//  OSC receive side to go with fishuyo's client
+//    Packets are walked in place: once to validate them, once to dispatch.
+//    Exact addresses are looked up in a hash table. Incoming patterns are
+//    matched against all handlers once and the result is cached.
+
+#include <string.h>
+
+#include <netinet/in.h>
+
+#include "osc_server.h"
+
+static uint32_t osc_read32( const char* p){
+
+  uint32_t val;
+  memcpy( &val, p, 4);
+  return ntohl( val);
+
+}
+
+// FNV-1a, also checks for pattern characters on the way
+static uint32_t osc_hash( const char* str, int* pattern){
+
+  uint32_t hash = 2166136261u;
+  *pattern = 0;
+
+  for( ; *str; str++){
+    if( *str == '*' || *str == '?' || *str == '[' || *str == '{') *pattern = 1;
+    hash = (hash ^ (uint8_t)*str) * 16777619u;
+  }
+  return hash;
+
+}
+
+// length of the string at p including padding, -1 if it isn't terminated before end
+static int osc_paddedLength( const char* p, const char* end){
+
+  const char* term = memchr( p, '\0', end - p);
+  if( !term) return -1;
+  return (term - p + 4) & ~3;
+
+}
+
+// size of an argument's data, -1 if it is unknown or doesn't fit
+static int osc_argSize( char type, const char* p, const char* end){
+
+  int32_t size;
+
+  switch( type){
+  case 'i': case 'f': case 'c': case 'r': case 'm':
+    size = 4;
+    break;
+  case 'h': case 't': case 'd':
+    size = 8;
+    break;
+  case 's': case 'S':
+    return osc_paddedLength( p, end);
+  case 'b':
+    if( end - p < 4) return -1;
+    size = (int32_t)osc_read32( p);
+    if( size < 0 || size > end - p - 4) return -1;
+    size = 4 + ((size + 3) & ~3);
+    break;
+  case 'T': case 'F': case 'N': case 'I': case '[': case ']':
+    return 0;
+  default:
+    return -1;
+  }
+  return size <= end - p ? size : -1;
+
+}
+
+void osc_server_init( OSCserver* srv){
+
+  srv->numhandlers = 0;
+  memset( srv->buckets, -1, sizeof( srv->buckets));
+  memset( srv->patterns, 0, sizeof( srv->patterns));
+  srv->nextpattern = 0;
+
+}
+
+int osc_server_add( OSCserver* srv, const char* address, OSChandler handler, void* user){
+
+  OSChandler_entry* entry;
+  int pattern, bucket, i;
+
+  if( srv->numhandlers >= OSC_MAX_HANDLERS) return 0;
+  if( address[0] != '/' || !handler) return 0;
+
+  entry = &srv->handlers[srv->numhandlers];
+  entry->address = address;
+  entry->hash = osc_hash( address, &pattern);
+  if( pattern) return 0;
+  entry->handler = handler;
+  entry->user = user;
+
+  // append, so handlers for the same address are called in registration order
+  bucket = entry->hash & (OSC_HASH_SIZE - 1);
+  entry->next = -1;
+  if( srv->buckets[bucket] < 0)
+    srv->buckets[bucket] = srv->numhandlers;
+  else {
+    for( i = srv->buckets[bucket]; srv->handlers[i].next >= 0; i = srv->handlers[i].next);
+    srv->handlers[i].next = srv->numhandlers;
+  }
+  srv->numhandlers++;
+
+  // cached matches don't know the new handler
+  for( i = 0; i < OSC_PATTERN_CACHE_SIZE; i++)
+    srv->patterns[i].pattern[0] = '\0';
+
+  return 1;
+
+}
+
+static uint32_t osc_server_matches( OSCserver* srv, const char* pattern, uint32_t hash){
+
+  OSCpattern_entry* entry;
+  uint32_t matches = 0;
+  int i;
+
+  for( i = 0; i < OSC_PATTERN_CACHE_SIZE; i++){
+    entry = &srv->patterns[i];
+    if( entry->hash == hash && entry->pattern[0] && strcmp( entry->pattern, pattern) == 0)
+      return entry->matches;
+  }
+
+  for( i = 0; i < srv->numhandlers; i++)
+    if( osc_pattern_match( pattern, srv->handlers[i].address))
+      matches |= 1u << i;
+
+  if( strlen( pattern) < OSC_PATTERN_MAX_LENGTH){
+    entry = &srv->patterns[srv->nextpattern];
+    srv->nextpattern = (srv->nextpattern + 1) % OSC_PATTERN_CACHE_SIZE;
+    strcpy( entry->pattern, pattern);
+    entry->hash = hash;
+    entry->matches = matches;
+  }
+  return matches;
+
+}
+
+static int osc_server_call( OSCserver* srv, OSCmsg* msg){
+
+  OSChandler_entry* entry;
+  uint32_t hash, matches;
+  int pattern, i, calls = 0;
+
+  hash = osc_hash( msg->address, &pattern);
+
+  if( !pattern){
+    for( i = srv->buckets[hash & (OSC_HASH_SIZE - 1)]; i >= 0; i = entry->next){
+      entry = &srv->handlers[i];
+      if( entry->hash == hash && strcmp( entry->address, msg->address) == 0){
+        entry->handler( msg, entry->user);
+        calls++;
+      }
+    }
+    return calls;
+  }
+
+  matches = osc_server_matches( srv, msg->address, hash);
+  for( i = 0; matches; i++, matches >>= 1){
+    if( matches & 1){
+      entry = &srv->handlers[i];
+      entry->handler( msg, entry->user);
+      calls++;
+    }
+  }
+  return calls;
+
+}
+
+static int osc_parseMessage( char* p, char* end, OSCmsg* msg){
+
+  int len, i, size;
+
+  len = osc_paddedLength( p, end);
+  if( len < 0) return 0;
+  msg->address = p;
+  p += len;
+
+  if( p == end){
+    // no type tags, treated as a message without arguments
+    msg->types = msg->address + len - 1;
+    msg->numargs = 0;
+  } else {
+    if( *p != ',') return 0;
+    len = osc_paddedLength( p, end);
+    if( len < 0) return 0;
+    msg->types = p + 1;
+    msg->numargs = strlen( msg->types);
+    p += len;
+  }
+
+  msg->args = p;
+  for( i = 0; i < msg->numargs; i++){
+    size = osc_argSize( msg->types[i], p, end);
+    if( size < 0) return 0;
+    p += size;
+  }
+  msg->end = end;
+  return p == end;
+
+}
+
+static int osc_walk( OSCserver* srv, char* p, int size, uint32_t sec, uint32_t frac, int depth, int dispatch){
+
+  char* end = p + size;
+  OSCmsg msg;
+  int32_t elemsize;
+  int res, calls = 0;
+
+  if( size <= 0 || size % 4 != 0) return -1;
+
+  if( p[0] == '/'){
+    if( !osc_parseMessage( p, end, &msg)) return -1;
+    msg.timetag_sec = sec;
+    msg.timetag_frac = frac;
+    return dispatch ? osc_server_call( srv, &msg) : 0;
+  }
+
+  if( size < 16 || memcmp( p, "#bundle", 8) != 0) return -1;
+  if( depth >= OSC_MAX_BUNDLE_DEPTH) return -1;
+
+  sec = osc_read32( p + 8);
+  frac = osc_read32( p + 12);
+  for( p += 16; p < end; p += 4 + elemsize){
+    if( end - p < 4) return -1;
+    elemsize = (int32_t)osc_read32( p);
+    if( elemsize <= 0 || elemsize > end - p - 4) return -1;
+    res = osc_walk( srv, p + 4, elemsize, sec, frac, depth + 1, dispatch);
+    if( res < 0) return -1;
+    calls += res;
+  }
+  return calls;
+
+}
+
+int osc_server_dispatch( OSCserver* srv, char* packet, int size){
+
+  if( osc_walk( srv, packet, size, 0, 1, 0, 0) < 0) return -1;
+  return osc_walk( srv, packet, size, 0, 1, 0, 1);
+
+}
+
+int osc_pattern_match( const char* pattern, const char* address){
+
+  const char *alt, *close, *sep;
+  int negate, hit;
+
+  for(;;){
+    switch( *pattern){
+    case '\0':
+      return *address == '\0';
+
+    case '*':
+      // '*' doesn't match across parts of the address
+      while( *pattern == '*') pattern++;
+      for( ;; address++){
+        if( osc_pattern_match( pattern, address)) return 1;
+        if( *address == '\0' || *address == '/') return 0;
+      }
+
+    case '?':
+      if( *address == '\0' || *address == '/') return 0;
+      pattern++;
+      address++;
+      break;
+
+    case '[':
+      if( *address == '\0' || *address == '/') return 0;
+      pattern++;
+      negate = *pattern == '!';
+      if( negate) pattern++;
+      hit = 0;
+      while( *pattern && *pattern != ']'){
+        if( pattern[1] == '-' && pattern[2] && pattern[2] != ']'){
+          if( *address >= pattern[0] && *address <= pattern[2]) hit = 1;
+          pattern += 3;
+        } else {
+          if( *address == *pattern) hit = 1;
+          pattern++;
+        }
+      }
+      if( *pattern != ']' || hit == negate) return 0;
+      pattern++;
+      address++;
+      break;
+
+    case '{':
+      close = strchr( pattern, '}');
+      if( !close) return 0;
+      for( alt = pattern + 1; alt <= close; alt = sep + 1){
+        for( sep = alt; sep < close && *sep != ','; sep++);
+        if( strncmp( alt, address, sep - alt) == 0 && osc_pattern_match( close + 1, address + (sep - alt)))
+          return 1;
+      }
+      return 0;
+
+    default:
+      if( *pattern != *address) return 0;
+      pattern++;
+      address++;
+      break;
+    }
+  }
+
+}
+
+// finds argument index, returns its type or 0
+static char osc_msg_arg( OSCmsg* msg, int index, char** arg){
+
+  char* p = msg->args;
+  int i;
+
+  if( index < 0 || index >= msg->numargs) return 0;
+  for( i = 0; i < index; i++)
+    p += osc_argSize( msg->types[i], p, msg->end);
+  *arg = p;
+  return msg->types[index];
+
+}
+
+int osc_msg_getint( OSCmsg* msg, int index, int32_t* arg){
+
+  char* p;
+  uint32_t val;
+  float f;
+
+  switch( osc_msg_arg( msg, index, &p)){
+  case 'i':
+    *arg = (int32_t)osc_read32( p);
+    return 1;
+  case 'f':
+    val = osc_read32( p);
+    memcpy( &f, &val, 4);
+    *arg = (int32_t)f;
+    return 1;
+  }
+  return 0;
+
+}
+
+int osc_msg_getfloat( OSCmsg* msg, int index, float* arg){
+
+  char* p;
+  uint32_t val;
+
+  switch( osc_msg_arg( msg, index, &p)){
+  case 'f':
+    val = osc_read32( p);
+    memcpy( arg, &val, 4);
+    return 1;
+  case 'i':
+    *arg = (float)(int32_t)osc_read32( p);
+    return 1;
+  }
+  return 0;
+
+}
+
+int osc_msg_getstring( OSCmsg* msg, int index, char** arg){
+
+  char type = osc_msg_arg( msg, index, arg);
+  return type == 's' || type == 'S';
+
+}
+
+int osc_msg_getblob( OSCmsg* msg, int index, char** data, int* size){
+
+  char* p;
+
+  if( osc_msg_arg( msg, index, &p) != 'b') return 0;
+  *size = (int32_t)osc_read32( p);
+  *data = p + 4;
+  return 1;
+
+}
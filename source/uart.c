@@ -19,73 +19,160 @@
 
 #include <nds.h>
 #include <nds/bios.h>	// for swi_delay()
-#include <string.h>		// for memmove()
+#include <string.h>		// for memcpy()
 #include <time.h>		// for time()
 #include <stdio.h>
 #include "uart.h"
 #include "spi.h"
-
-
-#define UART_FIFO_BLOCK_SIZE	8				// number of bytes to purge at once from overflowing in-buffer
-#define UART_IN_EMERG			8				// additional reserved bytes for in-buffer
-#define UART_IN_SIZE			256				// size of in-buffer
-#define UART_OUT_EMERG			4				// additional reserved bytes for out-buffer
-#define UART_OUT_SIZE			256				// size of out-buffer
-#define UART_SPI_RATE			2000			// default bps for spi timer
+#include "dsmi_stats.h"
+
+
+#ifndef UART_IN_SIZE
+#define UART_IN_SIZE			256				// size of in-buffer (power of two)
+#endif
+#ifndef UART_OUT_SIZE
+#define UART_OUT_SIZE			256				// size of out-buffer (power of two)
+#endif
+#define UART_IN_MASK			(UART_IN_SIZE-1)
+#define UART_OUT_MASK			(UART_OUT_SIZE-1)
+#define UART_PRIO_SIZE			8				// size of priority-buffer
+#define UART_RT_SIZE			16				// size of realtime-buffer (power of two)
+#define UART_RT_MASK			(UART_RT_SIZE-1)
+#define UART_SPI_RATE			1000			// default irq rate while busy, UART_SPI_BURST bytes each
+#define UART_SPI_RATE_IDLE		100				// default bps for spi timer while idle
+#define UART_SPI_IDLE_MS		50				// quiet time before falling back to idle
+#ifndef UART_SPI_BURST
+#define UART_SPI_BURST			8				// max. bytes exchanged per irq (chip select held)
+#endif
 #define UART_SPI_SPEED			CARD_SPI_524_KHZ_CLOCK	// spi speed (see spi.h)
 #define UART_TIMER_OFF			0xFF			// timer-off value (used for timer)
 
+#if (UART_IN_SIZE & UART_IN_MASK) || UART_IN_SIZE > 32768
+#error "UART_IN_SIZE must be a power of two (max. 32768)"
+#endif
+#if (UART_OUT_SIZE & UART_OUT_MASK) || UART_OUT_SIZE > 32768
+#error "UART_OUT_SIZE must be a power of two (max. 32768)"
+#endif
+
+// keeps the compiler from moving buffer accesses across index updates
+#define barrier()				__asm__ __volatile__ ("" ::: "memory")
+
 
+// in[] and out[] are single-producer/single-consumer rings. the head 
+// and tail indices are free-running and only masked on access, so 
+// tail-head is always the number of bytes queued. in_tail and out_head 
+// are only written by do_spi(), in_head and out_tail only by the main 
+// thread.
 static float spi_rate = 0.0;					// true spi rate
-static uint8 in[UART_IN_SIZE+UART_IN_EMERG];	// incoming buffer
-static uint16 in_size = 0;						// number of bytes in in-buffer
-static uint8 out[UART_OUT_SIZE+UART_OUT_EMERG];	// outgoing buffer
-static uint16 out_head = 0;						// index of next byte to send [0..n]
-static uint16 out_size = 0;						// number of bytes in out-buffer
+static uint8 in[UART_IN_SIZE];					// incoming buffer
+static volatile uint16 in_head = 0;				// index of next byte to read
+static volatile uint16 in_tail = 0;				// index of next free byte
+static uint8 out[UART_OUT_SIZE];				// outgoing buffer
+static volatile uint16 out_head = 0;			// index of next byte to send
+static volatile uint16 out_tail = 0;			// index of next free byte
+static uint8 rt[UART_RT_SIZE];					// realtime buffer
+static volatile uint16 rt_head = 0;				// index of next realtime-byte to send
+static volatile uint16 rt_tail = 0;				// index of next free realtime-byte
+static uint8 prio[UART_PRIO_SIZE];				// priority buffer
 static uint8 *prio_dest = NULL;					// destination buffer for raw data
-static uint16 prio_head = 0;					// index of next raw-byte to send [0..n]
+static volatile uint16 prio_head = 0;			// index of next raw-byte to send [0..n]
 static uint32 prio_irq_bytes = 0;				// bitmask for disabling the timer irq
-static uint16 prio_size = 0;					// number of raw-bytes in out buffer
+static volatile uint16 prio_size = 0;			// number of raw-bytes in priority buffer
 static uint8 timer = UART_TIMER_OFF;			// timer number
+static uint32 spi_bps = 0;						// bps the timer is set to
+static uint32 spi_bps_busy = UART_SPI_RATE;		// bps while bytes are moving
+static uint32 spi_bps_idle = UART_SPI_RATE_IDLE;	// bps while quiet
+static uint16 spi_idle_ticks = 0;				// quiet ticks at the busy rate
+static uint16 spi_idle_limit = 0;				// quiet ticks before slowing down
+static volatile uint32 timer_irqs = 0;			// number of timer irqs
+static volatile uint32 line_irqs = 0;			// number of card line irqs
+static bool spi_receiving = false;				// the last irq brought in bytes
+static uint16 spi_in_mark = 0;					// in_tail after the last irq
+static void (*receive_handler)(void) = NULL;	// called when bytes came in
+static void (*send_handler)(void) = NULL;		// called when the out-buffer has room
 static uint16 water_high = 0;					// 0 to turn off, 1..100
 static uint16 water_low = 0;					// 0 to turn off, 1..100
 static bool water_send = false;					// true if highwater notification has been send
 static int inittimeout = 10;					// timeout for uart_init
+static uint8 initmsg[3];						// version request of uart_init_poll
+static bool initprobing = false;				// initmsg is being sent
 
 
 // needed forward declarations
 static void do_spi();
+static void lock();
+static void unlock();
 static void send_watermark(bool highwater);
 static void timer_start();
 static void timer_stop();
+static void timer_set_rate(uint32 bps);
+
+
+static void adapt_rate(bool active)
+{
+	// runs fast while bytes go either way and falls back to the idle 
+	// rate after UART_SPI_IDLE_MS without any
+	if (active) {
+		spi_idle_ticks = 0;
+		if (spi_bps != spi_bps_busy)
+			timer_set_rate(spi_bps_busy);
+	} else if (spi_bps != spi_bps_idle && ++spi_idle_ticks >= spi_idle_limit) {
+		timer_set_rate(spi_bps_idle);
+	}
+}
 
 
 static void card_line_irq()
 {
-	// received a card line irq
+	// received a card line irq, the device has something for us
+	line_irqs++;
 	do_spi();
+	if (prio_head >= prio_size)
+		adapt_rate(true);
 }
 
 
-static void do_spi()
+// exchanges one byte, returns true unless both directions were idle
+static bool exchange()
 {
 	static bool got_esc = false;
-	uint8 read;
+	static bool out_esc = false;
+	uint8 read, send;
+	uint16 in_size;
+	bool active = true;
 	
 	// send byte
-	if (out_head < out_size) {
-		writeBlocking_cardSPI(out[out_head]);
+	if (prio_head < prio_size) {
+		// priority bytes go out before the normal queue
+		writeBlocking_cardSPI(prio[prio_head]);
+	} else if (rt_head != rt_tail && !out_esc) {
+		// realtime bytes cut ahead of the normal queue, but never 
+		// between an escape byte and the byte it escapes
+		writeBlocking_cardSPI(rt[rt_head & UART_RT_MASK]);
+		barrier();
+		rt_head++;
+		DSMI_COUNT(iface[DSMI_BRUT].bytes_out, 1);
+	} else if (out_head != out_tail) {
+		send = out[out_head & UART_OUT_MASK];
+		writeBlocking_cardSPI(send);
+		out_esc = !out_esc && send == '\\';
+		barrier();
 		out_head++;
+		if (out_esc) {
+			DSMI_COUNT(escape_bytes, 1);
+		} else {
+			DSMI_COUNT(iface[DSMI_BRUT].bytes_out, 1);
+		}
 	} else {
 		// write dummy byte
 		writeBlocking_cardSPI(0x00);
+		active = false;
 	}
 	
 	// read in byte
 	readBlocking_cardSPI(&read);
-	
-	// make sure the timer irq is on for the following byte
-	timer_start();
+	if (read != 0x00 && read != 0xff)
+		active = true;
 	
 	// handle raw (priority) buffer
 	if (prio_head < prio_size) {
@@ -104,7 +191,7 @@ static void do_spi()
 				prio_dest[prio_head] = read;
 			}
 			prio_head++;
-			return;
+			return active;
 		}
 	}
 	
@@ -112,16 +199,19 @@ static void do_spi()
 	if (!got_esc && read == '\\') {
 		// remove escape byte
 		got_esc = true;
-		return;
+		DSMI_COUNT(escape_bytes, 1);
+		return active;
 	} else if (got_esc) {
 		// read can now be a null byte, a backslash, 0xff or any other char
 		got_esc = false;
 	} else if (read == 0x00 || read == 0xff) {
 		// remove dummy byte (0x00)
 		// remove byte we get when no cartridge is inserted (0xff)
-		return;
+		return active;
 	}
 	
+	in_size = in_tail - in_head;
+	
 	// watermarks
 	if (0 < water_high && in_size+1 >= water_high && !water_send) {
 		// hit high water
@@ -134,16 +224,75 @@ static void do_spi()
 		water_send = false;
 	}
 	
-	// make some room
+	// in-buffer full? (we can't discard the oldest bytes here, as 
+	// in_head belongs to the reader)
 	if (in_size == UART_IN_SIZE) {
-		// discard oldest bytes in queue
-		memmove(in, in+UART_FIFO_BLOCK_SIZE, UART_IN_SIZE-UART_FIFO_BLOCK_SIZE);
-		in_size -= UART_FIFO_BLOCK_SIZE;
+		DSMI_COUNT(iface[DSMI_BRUT].drops_in, 1);
+		return active;
 	}
 	
 	// add byte to buffer
-	in[in_size] = read;
-	in_size++;
+	in[in_tail & UART_IN_MASK] = read;
+	barrier();
+	in_tail++;
+	DSMI_COUNT(iface[DSMI_BRUT].bytes_in, 1);
+	
+	return active;
+}
+
+
+static uint16 burst_size()
+{
+	uint16 n = (uint16)(rt_tail-rt_head) + (uint16)(out_tail-out_head);
+	
+	// keep pulling while bytes are coming in, as long as they fit
+	if (spi_receiving && n < UART_SPI_BURST 
+		&& UART_SPI_BURST <= UART_IN_SIZE-(uint16)(in_tail-in_head)) {
+		n = UART_SPI_BURST;
+	}
+	
+	if (n < 1)
+		return 1;
+	return n < UART_SPI_BURST ? n : UART_SPI_BURST;
+}
+
+
+static void do_spi()
+{
+	uint16 i, n = 1;
+	bool active = false;
+	DSMI_HIST_DECL(start);
+	
+	DSMI_HIST_BEGIN(start);
+	DSMI_COUNT(spi_transactions, 1);
+	
+	// make sure the timer irq is on for the following byte
+	timer_start();
+	
+	// priority bytes go one per irq, as they might stop the timer
+	if (prio_head >= prio_size)
+		n = burst_size();
+	
+	// hold chip select over the burst
+	if (1 < n)
+		setupConsecutive_cardSPI(n);
+	for (i=0; i<n; i++) {
+		if (exchange())
+			active = true;
+	}
+	spi_receiving = active && in_tail != spi_in_mark;
+	spi_in_mark = in_tail;
+	
+	if (spi_receiving && receive_handler)
+		receive_handler();
+	if (send_handler && (uint16)(out_tail-out_head) <= UART_OUT_SIZE/2)
+		send_handler();
+	
+	// the rate is left alone while priority bytes might stop the timer
+	if (prio_head >= prio_size)
+		adapt_rate(active);
+	
+	DSMI_HIST_END(DSMI_HIST_DO_SPI, start);
 }
 
 
@@ -166,15 +315,54 @@ static void send_watermark(bool highwater)
 }
 
 
+static void spi_wake()
+{
+	// called before queueing bytes, so they don't wait for an idle tick
+	if (spi_bps != spi_bps_busy && prio_head >= prio_size) {
+		lock();
+		spi_idle_ticks = 0;
+		timer_set_rate(spi_bps_busy);
+		unlock();
+	}
+}
+
+
 static void timer_irq()
 {
+	timer_irqs++;
 	do_spi();
 }
 
 
+static void timer_set_rate(uint32 bps)
+{
+	if (timer == UART_TIMER_OFF)
+		return;
+	
+	if (bps <= 32768) {
+		TIMER_DATA(timer) = timerFreqToTicks_1024(bps);
+		TIMER_CR(timer) = TIMER_DIV_1024|TIMER_ENABLE|TIMER_IRQ_REQ;
+		spi_rate = 33.51392 / ((0x2000000 >> 10) / bps) * 1000;
+	} else if (bps <= 131072) {
+		TIMER_DATA(timer) = timerFreqToTicks_256(bps);
+		TIMER_CR(timer) = TIMER_DIV_256|TIMER_ENABLE|TIMER_IRQ_REQ;
+		spi_rate = 33.51392 / ((0x2000000 >> 8) / bps) * 1000;
+	} else if (bps <= 524288) {
+		TIMER_DATA(timer) = timerFreqToTicks_64(bps);
+		TIMER_CR(timer) = TIMER_DIV_64|TIMER_ENABLE|TIMER_IRQ_REQ;
+		spi_rate = 33.51392 / ((0x2000000 >> 6) / bps) * 1000;
+	} else {
+		TIMER_DATA(timer) = timerFreqToTicks_1(bps);
+		TIMER_CR(timer) = TIMER_DIV_1|TIMER_ENABLE|TIMER_IRQ_REQ;
+		spi_rate = 33.51392 / (0x2000000 / bps) * 1000;
+	}
+	spi_bps = bps;
+}
+
+
 static void timer_start()
 {
-	if (timer != UART_TIMER_OFF) {
+	if (timer != UART_TIMER_OFF && !(TIMER_CR(timer) & TIMER_ENABLE)) {
 		TIMER_CR(timer) |= TIMER_ENABLE;
 	}
 }
@@ -199,18 +387,29 @@ static void unlock()
 // library functions
 
 bool uart_init()
+{
+	int8 ready;
+	
+	if (!uart_init_begin())
+		return false;
+	
+	while ((ready = uart_init_poll()) == 0)
+		uart_wait();
+	
+	return ready > 0;
+}
+
+
+bool uart_init_begin()
 {
 	int8 i;
-	uint8 ver;
 	
 	if (timer != UART_TIMER_OFF)
 		return false;
 	
-	// setup access
+	// setup access (on the arm7 the arm9 has to hand over the card bus)
 #ifdef ARM9
 	REG_EXMEMCNT &= ~ARM7_OWNS_CARD;
-#else
-	REG_EXMEMCNT |= ARM7_OWNS_CARD;
 #endif	// ARM9
 	
 	init_cardSPI();
@@ -233,76 +432,93 @@ bool uart_init()
 		irqSet((IRQ_MASK)BIT(i+3), timer_irq);
 		irqEnable((IRQ_MASK)BIT(i+3));
 		// set default bps and enable timer
-		uart_set_spi_rate(UART_SPI_RATE);
-		// wait for the card to be ready
-		do {
-
-			ver = uart_firmware_ver();
-			uart_wait();
-			if (ver != 0x00 && ver != 0xff) {
-			
-				return true;
-				
-			} else if (inittimeout == 0 || ver == 0x00) {
-				disable_cardSPI();
-				irqDisable((IRQ_MASK)BIT(i+3));
-				
-				return false;
-			}
-			
-			inittimeout--;
-			
-		} while (true);
+		uart_set_spi_rates(UART_SPI_RATE_IDLE, UART_SPI_RATE);
+		inittimeout = 10;
+		initprobing = false;
+		
+		return true;
 	}
 	
 	return false;
 }
 
 
-uint16 uart_write(uint8 *buf, uint16 size)
+int8 uart_init_poll()
 {
-	uint16 i;
-	uint16 ret = 0;	
-
-	// prevent do_spi() from changing buffers
-	lock();
+	uint8 ver;
 	
-	// remove digested bytes from queue
-	if (out_head > 0) {
-		memmove(out, out+out_head, out_size-out_head);
-		out_size -= out_head;
-		out_head = 0;
+	if (timer == UART_TIMER_OFF)
+		return -1;
+	
+	// ask for the firmware version, the answer comes with the next polls
+	if (!initprobing) {
+		initmsg[0] = '\\';
+		initmsg[1] = 'v';
+		initmsg[2] = 0x00;
+		uart_write_prio(initmsg, 3, initmsg, 0x00);
+		initprobing = true;
+		return 0;
 	}
 	
+	if (prio_head != prio_size)
+		return 0;
+	
+	prio_size = 0;
+	prio_head = 0;
+	initprobing = false;
+	
+	// wait for the card to be ready
+	ver = initmsg[2];
+	if (ver != 0x00 && ver != 0xff) {
+		
+		return 1;
+		
+	} else if (inittimeout == 0 || ver == 0x00) {
+		disable_cardSPI();
+		irqDisable((IRQ_MASK)BIT(timer+3));
+		
+		return -1;
+	}
+	
+	inittimeout--;
+	
+	return 0;
+}
+
+
+uint16 uart_write(uint8 *buf, uint16 size)
+{
+	uint16 i;
+	uint16 tail = out_tail;
+	uint16 space = UART_OUT_SIZE - (uint16)(tail - out_head);
+	
 	// add buffer
 	for (i=0; i<size; i++) {
-		if (*(buf+i) == 0x00) {
-			// escape null-bytes
-			if (out_size + 2 > UART_OUT_SIZE)
-				break;
-			out[out_size] = '\\';
-			out[out_size+1] = 0x00;
-			out_size += 2;
-		} else if (*(buf+i) == '\\') {
-			// escape backslashes
-			if (out_size + 2 > UART_OUT_SIZE)
+		if (*(buf+i) == 0x00 || *(buf+i) == '\\') {
+			// escape null-bytes and backslashes
+			if (space < 2)
 				break;
-			out[out_size] = '\\';
-			out[out_size+1] = '\\';
-			out_size += 2;
+			out[tail++ & UART_OUT_MASK] = '\\';
+			out[tail++ & UART_OUT_MASK] = *(buf+i);
+			space -= 2;
 		} else {
-			if (out_size + 1 > UART_OUT_SIZE)
+			if (space < 1)
 				break;
-			out[out_size] = *(buf+i);
-			out_size++;
+			out[tail++ & UART_OUT_MASK] = *(buf+i);
+			space--;
 		}
-		ret++;
 	}
 	
-	unlock();
+	// publish the new bytes to do_spi()
+	barrier();
+	out_tail = tail;
 	
+	if (0 < i)
+		spi_wake();
+	if (i < size)
+		DSMI_COUNT(iface[DSMI_BRUT].short_writes, 1);
 	
-	return ret;
+	return i;
 }
 
 
@@ -326,9 +542,34 @@ void uart_sendc(char c)
 }
 
 
+uint16 uart_write_rt(uint8 *buf, uint16 size)
+{
+	uint16 i;
+	uint16 tail = rt_tail;
+	
+	for (i=0; i<size; i++) {
+		if ((uint16)(tail - rt_head) == UART_RT_SIZE)
+			break;
+		// these would need escaping
+		if (*(buf+i) == 0x00 || *(buf+i) == '\\')
+			continue;
+		rt[tail++ & UART_RT_MASK] = *(buf+i);
+	}
+	
+	// publish the new bytes to do_spi()
+	barrier();
+	rt_tail = tail;
+	
+	if (0 < i)
+		spi_wake();
+	
+	return i;
+}
+
+
 void uart_flush()
 {
-	while (out_head < out_size) {
+	while (out_head != out_tail || rt_head != rt_tail) {
 		uart_wait();
 	}
 }
@@ -336,30 +577,56 @@ void uart_flush()
 
 uint16 uart_available()
 {
-	return in_size;
+	return in_tail - in_head;
+}
+
+
+uint16 uart_writable()
+{
+	return UART_OUT_SIZE - (uint16)(out_tail - out_head);
 }
 
 
 uint16 uart_read(uint8 *dest, uint16 size)
 {
-	uint16 read = size;
-	
+	uint16 head = in_head;
+	uint16 read = in_tail - head;
+	uint16 first;
 	
-	// prevent do_spi() from changing buffers
-	lock();
+	if (size < read)
+		read = size;
 	
-	if (in_size < read)
-		read = in_size;
-	memcpy(dest, in, read);
+	// copy in (at most) two pieces, as the data might wrap around
+	first = UART_IN_SIZE - (head & UART_IN_MASK);
+	if (read < first)
+		first = read;
+	memcpy(dest, in+(head & UART_IN_MASK), first);
+	memcpy(dest+first, in, read-first);
 	
-	// move remaining in-buffer
-	memmove(in, in+read, in_size-read);
-	in_size -= read;
+	// hand the space back to do_spi()
+	barrier();
+	in_head = head+read;
 	
-	unlock();
+	return read;
+}
+
+
+uint16 uart_peek(uint8 **buf)
+{
+	uint16 head = in_head;
+	uint16 size = in_tail - head;
+	uint16 first = UART_IN_SIZE - (head & UART_IN_MASK);
 	
+	*buf = in+(head & UART_IN_MASK);
 	
-	return read;
+	return size < first ? size : first;
+}
+
+
+void uart_skip(uint16 size)
+{
+	barrier();
+	in_head += size;
 }
 
 
@@ -379,23 +646,20 @@ uint16 uart_readstr(char *dest, uint16 size)
 
 uint16 uart_readln(char *dest, uint16 size, char nl)
 {
-	uint16 i;
-	
-	
-	// prevent do_spi() from changing buffers
-	lock();
+	uint16 head = in_head;
+	uint16 in_size = in_tail - head;
+	uint16 i, j;
 	
 	// look for newline
 	for (i=0; i<in_size; i++) {
-		if (in[i] == nl) {
+		if (in[(head+i) & UART_IN_MASK] == nl) {
 			break;
 		}
 	}
 	
 	// nothing found?
 	if (i == in_size) {
-		size = 0;
-		goto out;
+		return 0;
 	}
 	
 	// reserve a character for null-termination
@@ -404,20 +668,16 @@ uint16 uart_readln(char *dest, uint16 size, char nl)
 	// copy to destination
 	if (i+1 < size)
 		size = i+1;
-	memcpy(dest, in+i+1-size, size);
+	for (j=0; j<size; j++) {
+		dest[j] = in[(head+i+1-size+j) & UART_IN_MASK];
+	}
 	
 	// make string null-terminated
 	dest[size] = '\0';
 	
-	// move remaining in-buffer
-	if (i+1 < in_size) {
-		memmove(in, in+i+1, in_size-i-1);
-		in_size -= i+1;
-	}
-	
-out:
-	unlock();
-	
+	// remove the line from the in-buffer
+	barrier();
+	in_head = head+i+1;
 	
 	// return the number of characters (sans null)
 	return size;
@@ -426,16 +686,19 @@ out:
 
 bool uart_requeue(uint8 *src, uint16 size)
 {
-
+	uint16 i;
+	
 	// prevent do_spi() from changing buffers
 	lock();
 	
 	// we are only doing this if we are not throwing away other
 	// valid bytes while doing so
-	if (size+in_size <= UART_IN_SIZE+UART_IN_EMERG) {
-		memmove(in+size, in, in_size);
-		memcpy(out, src, size);
-		out_size += size;	
+	if (size+(uint16)(in_tail-in_head) <= UART_IN_SIZE) {
+		for (i=0; i<size; i++) {
+			in[(in_head-size+i) & UART_IN_MASK] = src[i];
+		}
+		barrier();
+		in_head -= size;
 		unlock();
 		
 		return true;
@@ -471,26 +734,39 @@ void uart_set_bps(uint32 bps)
 
 void uart_set_spi_rate(uint32 bps)
 {
-	if (timer == UART_TIMER_OFF)
+	uart_set_spi_rates(bps, bps);
+}
+
+
+void uart_set_spi_rates(uint32 idle, uint32 busy)
+{
+	if (timer == UART_TIMER_OFF || idle == 0 || busy == 0)
 		return;
 	
-	if (bps <= 32768) {
-		TIMER_DATA(timer) = timerFreqToTicks_1024(bps);
-		TIMER_CR(timer) = TIMER_DIV_1024|TIMER_ENABLE|TIMER_IRQ_REQ;
-		spi_rate = 33.51392 / ((0x2000000 >> 10) / bps) * 1000;
-	} else if (bps <= 131072) {
-		TIMER_DATA(timer) = timerFreqToTicks_256(bps);
-		TIMER_CR(timer) = TIMER_DIV_256|TIMER_ENABLE|TIMER_IRQ_REQ;
-		spi_rate = 33.51392 / ((0x2000000 >> 8) / bps) * 1000;
-	} else if (bps <= 524288) {
-		TIMER_DATA(timer) = timerFreqToTicks_64(bps);
-		TIMER_CR(timer) = TIMER_DIV_64|TIMER_ENABLE|TIMER_IRQ_REQ;
-		spi_rate = 33.51392 / ((0x2000000 >> 6) / bps) * 1000;
-	} else {
-		TIMER_DATA(timer) = timerFreqToTicks_1(bps);
-		TIMER_CR(timer) = TIMER_DIV_1|TIMER_ENABLE|TIMER_IRQ_REQ;
-		spi_rate = 33.51392 / (0x2000000 / bps) * 1000;
-	}
+	lock();
+	spi_bps_idle = idle;
+	spi_bps_busy = busy;
+	spi_idle_limit = busy * UART_SPI_IDLE_MS / 1000;
+	spi_idle_ticks = 0;
+	// start fast, after UART_SPI_IDLE_MS of silence it slows down
+	timer_set_rate(busy);
+	unlock();
+}
+
+
+void uart_set_receive_handler(void (*handler)(void))
+{
+	lock();
+	receive_handler = handler;
+	unlock();
+}
+
+
+void uart_set_send_handler(void (*handler)(void))
+{
+	lock();
+	send_handler = handler;
+	unlock();
 }
 
 
@@ -513,30 +789,30 @@ float uart_get_spi_rate()
 }
 
 
+void uart_get_irq_count(uint32 *timer_count, uint32 *line_count)
+{
+	if (timer_count)
+		*timer_count = timer_irqs;
+	if (line_count)
+		*line_count = line_irqs;
+}
+
+
 void uart_write_prio(uint8 *buf, uint16 size, uint8 *dest, uint32 irq_bytes)
 {
+	// check if we exceed the buffer size
+	if (UART_PRIO_SIZE < size)
+		return;
 	
+	// priority bytes can stop the timer, so run fast before they start
+	spi_wake();
 	
 	// prevent do_spi() from changing buffers
 	lock();
 	
-	// check if we exceed the buffer size
-	if (UART_OUT_SIZE+UART_OUT_EMERG < size)
-		return;
-	
-	if (size+out_size-out_head <= UART_OUT_SIZE+UART_OUT_EMERG) {
-		memmove(out+size, out+out_head, out_size-out_head);
-	} else {
-		// preserve the newer bytes in the queue
-		memmove(out+size, out+out_size-UART_OUT_SIZE+UART_OUT_EMERG-size, UART_OUT_SIZE+UART_OUT_EMERG-size);
-	}
-	memcpy(out, buf, size);
-	
-	// in the previous step we implicitly threw the bytes already 
-	// digested, that's why out_size ends up being the priority 
-	// bytes plus the remainder of the queue
-	out_size = size+out_size-out_head;
-	out_head = 0;
+	// the priority buffer is sent before anything in the normal 
+	// queue, so the bytes already queued are left untouched
+	memcpy(prio, buf, size);
 	
 	prio_dest = dest;
 	prio_head = 0;
@@ -544,8 +820,6 @@ void uart_write_prio(uint8 *buf, uint16 size, uint8 *dest, uint32 irq_bytes)
 	prio_size = size;
 	
 	unlock();
-	
-	
 }
 
 
@@ -565,8 +839,8 @@ bool uart_wait_prio(uint8 timeout)
 	} while (timeout == 0 || time(NULL)-start <= timeout);
 	
 	// we timed out, cleanup
+	DSMI_COUNT(prio_timeouts, 1);
 	lock();
-	out_head = prio_size;
 	prio_size = 0;
 	prio_head = 0;
 	unlock();